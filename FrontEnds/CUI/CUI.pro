@@ -17,7 +17,7 @@
 
 VERSION = 0.0.1
 
-QT       += core
+QT       += core network
 
 TARGET = dtw
 CONFIG   += console
@@ -27,7 +27,10 @@ TEMPLATE = app
 
 
 SOURCES += main.cpp \
+           batch.cpp \
+           daemon.cpp
 
-HEADERS +=
+HEADERS += batch.h \
+           daemon.h
 
 include(../../DyeTheWorld.pri)
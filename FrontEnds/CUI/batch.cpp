@@ -0,0 +1,275 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#include "batch.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QImage>
+#include <QImageReader>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QSet>
+#include <QSharedPointer>
+#include <QTextStream>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <cstdio>
+
+#include "dtwimage.h"
+#include "dtwprofiler.h"
+
+namespace {
+
+class Task : public QRunnable {
+    std::function<void()> body;
+public:
+    explicit Task(const std::function<void()>& body) : body(body) {}
+    void run() { body(); }
+};
+
+//Encoding frees memory, so it goes ahead of decoding in the I/O pool
+const int DECODE_PRIORITY = 0;
+const int ENCODE_PRIORITY = 1;
+
+}//namespace
+
+//An existing file is taken as it is, even when its name looks like a pattern
+static bool isWildcard(const QString& path)
+{
+    if (QFileInfo(path).isFile()) return false;
+    return path.contains('*') || path.contains('?') || path.contains('[');
+}
+
+bool isBatchSource(const QString& source)
+{
+    if (QFileInfo(source).isFile()) return false;
+    return isWildcard(source) || QFileInfo(source).isDir();
+}
+
+static QString destinationOf(const QString& relative, const QString& destination, const QString& suffix)
+{
+    const QString name = QDir(destination).filePath(relative);
+    if (suffix.isEmpty()) return name;
+    const QFileInfo info(name);
+    return info.dir().filePath(info.completeBaseName() + '.' + suffix);
+}
+
+static QList<BatchItem> readList(const QString& source, const QString& destination, const QString& suffix)
+{
+    QList<BatchItem> items;
+    QFile file(source);
+    const bool isOpen = (source == "-") ? file.open(stdin, QIODevice::ReadOnly | QIODevice::Text)
+                                        : file.open(QIODevice::ReadOnly | QIODevice::Text);
+    if (!isOpen) {
+        qCritical() << "Unable to read the file list:" << source;
+        return items;
+    }
+    QStringList paths, absolutes;
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        const QString path = in.readLine().trimmed();
+        if (path.isEmpty()) continue;
+        paths.append(path);
+        absolutes.append(QDir::cleanPath(QDir::current().absoluteFilePath(path)));
+    }
+
+    //Destinations are relative to the deepest directory holding the current
+    //one and every listed image: paths inside the current directory keep
+    //their names, others keep enough of theirs to stay apart
+    QStringList root = QDir::currentPath().split('/');
+    foreach (const QString& absolute, absolutes) {
+        const QStringList dirs = QFileInfo(absolute).absolutePath().split('/');
+        int common = 0;
+        while (common < root.size() && common < dirs.size() && root.at(common) == dirs.at(common))
+            common++;
+        root = root.mid(0, common);
+    }
+    const QDir base(root.join('/') + '/');
+    for (int i = 0; i < paths.size(); i++) {
+        const QString& path = paths.at(i);
+        const QString& absolute = absolutes.at(i);
+        QString relative = base.relativeFilePath(absolute);
+        //No common root, as with two drives
+        if (!QDir::isRelativePath(relative) || relative.startsWith("..")) relative = QFileInfo(absolute).fileName();
+        items.append(BatchItem(path, destinationOf(relative, destination, suffix)));
+    }
+    return items;
+}
+
+QList<BatchItem> collectBatch(const QString& source, bool isList, bool recursive,
+                              const QString& destination, const QString& suffix)
+{
+    if (isList) return readList(source, destination, suffix);
+
+    QList<BatchItem> items;
+    if (isWildcard(source)) {
+        const QFileInfo pattern(source);
+        const QDir dir = pattern.dir();
+        foreach (const QString& name, dir.entryList(QStringList(pattern.fileName()), QDir::Files, QDir::Name))
+            items.append(BatchItem(dir.filePath(name), destinationOf(name, destination, suffix)));
+        return items;
+    }
+
+    QStringList filters;
+    foreach (const QByteArray& format, QImageReader::supportedImageFormats())
+        filters << "*." + QString::fromLatin1(format);
+    const QDir root(source);
+    QDirIterator it(source, filters, QDir::Files,
+                    recursive ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags);
+    while (it.hasNext()) {
+        const QString path = it.next();
+        items.append(BatchItem(path, destinationOf(root.relativeFilePath(path), destination, suffix)));
+    }
+    std::sort(items.begin(), items.end());
+    return items;
+}
+
+bool hasDistinctDestinations(const QList<BatchItem>& items)
+{
+    QHash<QString, QString> sources;
+    bool isDistinct = true;
+    foreach (const BatchItem& item, items) {
+        const QString name = QDir::cleanPath(QFileInfo(item.second).absoluteFilePath());
+        if (sources.contains(name)) {
+            qCritical() << "Both" << sources.value(name) << "and" << item.first << "would be saved to" << item.second;
+            isDistinct = false;
+        } else {
+            sources.insert(name, item.first);
+        }
+    }
+    return isDistinct;
+}
+
+QString detailFileName(const QString& pattern, int details, bool isSeveral)
+{
+    if (pattern.contains("%1")) return pattern.arg(details);
+    if (!isSeveral) return pattern;
+    const QFileInfo info(pattern);
+    const QString name = info.completeBaseName() + '-' + QString::number(details);
+    return info.dir().filePath(info.suffix().isEmpty() ? name : name + '.' + info.suffix());
+}
+
+int savePages(const QList<QImage>& pages, const QStringList& names)
+{
+    PROFILE_FUNCTION();
+    Q_ASSERT(pages.size() == names.size());
+    QAtomicInt failures(0);
+    QThreadPool pool;
+    for (int i = 0; i < pages.size(); i++) {
+        const QImage page = pages.at(i);
+        const QString name = names.at(i);
+        pool.start(new Task([&failures, page, name]() {
+            if (!page.save(name)) {
+                qCritical() << "Unable to save destination image:" << name;
+                failures.ref();
+            }
+        }));
+    }
+    pool.waitForDone();
+    return failures.load();
+}
+
+int runBatch(const QList<BatchItem>& items, const QList<int>& details, int jobs, int inFlight)
+{
+    PROFILE_FUNCTION();
+    Q_ASSERT(jobs > 0 && inFlight > 0);
+
+    //Output directories are made up front, not by racing encoders
+    QSet<QString> dirs;
+    foreach (const BatchItem& item, items) {
+        foreach (const int level, details)
+            dirs.insert(QFileInfo(detailFileName(item.second, level, details.size() > 1)).absolutePath());
+    }
+    foreach (const QString& dir, dirs) {
+        if (!QDir().mkpath(dir)) qCritical() << "Unable to create directory:" << dir;
+    }
+
+    //Images are converted side by side, each of them by a single thread
+    const int libraryThreads = dtw::DtwImage::maxThreadCount();
+    dtw::DtwImage::setMaxThreadCount(1);
+
+    QSemaphore capacity(inFlight);
+    QAtomicInt failures(0);
+    QThreadPool computePool;
+    computePool.setMaxThreadCount(jobs);
+    //Decoding and encoding mostly wait for the disk
+    QThreadPool ioPool;
+    ioPool.setMaxThreadCount(qMax(2, jobs / 2));
+
+    foreach (const BatchItem& item, items) {
+        capacity.acquire();
+        ioPool.start(new Task([&, item]() {
+            QImage image;
+            {
+                PROFILE_SCOPE("batch decode");
+                image.load(item.first);
+            }
+            if (image.isNull()) {
+                qCritical() << "Unable to load source image:" << item.first;
+                failures.ref();
+                capacity.release();
+                return;
+            }
+            computePool.start(new Task([&, item, image]() {
+                QList<QImage> pages;
+                try {
+                    PROFILE_SCOPE("batch makeColoringPages");
+                    pages = dtw::DtwImage(image).makeColoringPages(details);
+                } catch (const std::exception& e) {
+                    qCritical() << "Unable to convert" << item.first << ":" << e.what();
+                    failures.ref();
+                    capacity.release();
+                    return;
+                }
+                //The pages are encoded side by side, the last one gives the slot back
+                QSharedPointer<QAtomicInt> remaining(new QAtomicInt(pages.size()));
+                QSharedPointer<QAtomicInt> isFailed(new QAtomicInt(0));
+                for (int i = 0; i < pages.size(); i++) {
+                    const QImage page = pages.at(i);
+                    const QString name = detailFileName(item.second, details.at(i), details.size() > 1);
+                    ioPool.start(new Task([&, page, name, remaining, isFailed]() {
+                        PROFILE_SCOPE("batch encode");
+                        if (!page.save(name)) {
+                            qCritical() << "Unable to save destination image:" << name;
+                            isFailed->storeRelease(1);
+                        }
+                        if (!remaining->deref()) {
+                            if (isFailed->loadAcquire()) failures.ref();
+                            capacity.release();
+                        }
+                    }), ENCODE_PRIORITY);
+                }
+            }));
+        }), DECODE_PRIORITY);
+    }
+
+    //Every image gives its slot back once it is done
+    capacity.acquire(inFlight);
+    ioPool.waitForDone();
+    computePool.waitForDone();
+    dtw::DtwImage::setMaxThreadCount(libraryThreads);
+    return failures.load();
+}
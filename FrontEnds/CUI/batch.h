@@ -0,0 +1,61 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <QImage>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QStringList>
+
+//Source and destination file names of one image
+typedef QPair<QString, QString> BatchItem;
+
+//Images named by "source": a directory, walked recursively with "recursive",
+//a wildcard pattern in the file name part of a path, or with "isList" a text
+//file naming one image per line ("-" reads the standard input).
+//Destinations keep the path relative to the source under "destination",
+//listed images the path relative to the deepest directory holding the
+//current one and all of them. "suffix" replaces the extension when it is
+//not empty.
+QList<BatchItem> collectBatch(const QString& source, bool isList, bool recursive,
+                              const QString& destination, const QString& suffix);
+
+//True if no two items share a destination, otherwise reports every clash,
+//as when "suffix" gives img.jpg and img.png the same name
+bool hasDistinctDestinations(const QList<BatchItem>& items);
+
+//True if "source" should be run as a batch rather than as a single image
+bool isBatchSource(const QString& source);
+
+//"pattern" with %1 replaced by the detail level. Without a %1, several
+//levels get "-<level>" in front of the extension.
+QString detailFileName(const QString& pattern, int details, bool isSeveral);
+
+//Saves pages.at(i) to names.at(i), side by side. Returns the number of failures.
+int savePages(const QList<QImage>& pages, const QStringList& names);
+
+//Converts the images on a pipeline: decoding and encoding run on an I/O pool
+//while the pages of all detail levels of an image are made on one of "jobs"
+//compute threads. At most "inFlight" images are held between decoding and
+//the end of encoding. Returns the number of images that failed.
+int runBatch(const QList<BatchItem>& items, const QList<int>& details, int jobs, int inFlight);
+
+#endif // BATCH_H
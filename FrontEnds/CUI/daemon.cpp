@@ -0,0 +1,263 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#include "daemon.h"
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QImageReader>
+#include <QJsonDocument>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMutexLocker>
+#include <QRunnable>
+
+#include <functional>
+#include <stdexcept>
+
+#include "dtwprofiler.h"
+
+using namespace dtw;
+
+//A line without its newline beyond this drops the connection
+static const qint64 MAX_REQUEST_BYTES = 64 * 1024;
+//Memory of a DtwImage and its caches per pixel, reserved before it is built
+static const qint64 ESTIMATED_BYTES_PER_PIXEL = 48;
+static const int PROBE_TIMEOUT_MS = 1000;
+
+ImageCache::ImageCache(qint64 capacity)
+    : capacity(capacity), total(0)
+{}
+
+QSharedPointer<ImageCache::Entry> ImageCache::entry(const QByteArray& key)
+{
+    QMutexLocker locker(&mutex);
+    QSharedPointer<Entry>& entry = entries[key];
+    if (entry.isNull()) {
+        entry = QSharedPointer<Entry>(new Entry);
+        costs.insert(key, 0);
+    } else {
+        order.removeOne(key);
+    }
+    order.prepend(key);
+    return entry;
+}
+
+void ImageCache::remove(const QByteArray& key)
+{
+    QMutexLocker locker(&mutex);
+    total -= costs.take(key);
+    entries.remove(key);
+    order.removeOne(key);
+}
+
+void ImageCache::setCost(const QByteArray& key, qint64 cost)
+{
+    QMutexLocker locker(&mutex);
+    if (!entries.contains(key)) return;
+    total += cost - costs.value(key);
+    costs[key] = cost;
+    //The entry just used stays even when it alone is over the capacity
+    while (total > capacity && order.size() > 1 && order.last() != key) {
+        const QByteArray oldest = order.takeLast();
+        total -= costs.take(oldest);
+        entries.remove(oldest);
+    }
+}
+
+namespace {
+
+class RequestTask : public QRunnable {
+    std::function<void()> body;
+public:
+    explicit RequestTask(const std::function<void()>& body) : body(body) {}
+    void run() { body(); }
+};
+
+QJsonObject failure(const QJsonObject& reply, const QString& error)
+{
+    QJsonObject result = reply;
+    result["ok"] = false;
+    result["error"] = error;
+    return result;
+}
+
+}//namespace
+
+Daemon::Daemon(int jobs, qint64 cacheBytes, QObject * parent)
+    : QObject(parent), server(new QLocalServer(this)), cache(cacheBytes), lastConnection(0)
+{
+    pool.setMaxThreadCount(jobs);
+    connect(server, SIGNAL(newConnection()), this, SLOT(onNewConnection()));
+    //Emitted from the pool, delivered in the thread owning the sockets
+    connect(this, SIGNAL(replyReady(quint64,QByteArray)), this, SLOT(sendReply(quint64,QByteArray)),
+            Qt::QueuedConnection);
+}
+
+//Requests still running use the cache
+Daemon::~Daemon()
+{
+    pool.waitForDone();
+}
+
+bool Daemon::listen(const QString& name)
+{
+    QLocalSocket probe;
+    probe.connectToServer(name);
+    if (probe.waitForConnected(PROBE_TIMEOUT_MS)) {
+        listenError = "Another daemon is listening";
+        return false;
+    }
+    //A socket file left behind by a crashed daemon would block the name
+    QLocalServer::removeServer(name);
+    listenError.clear();
+    return server->listen(name);
+}
+
+QString Daemon::errorString() const
+{
+    return listenError.isEmpty() ? server->errorString() : listenError;
+}
+
+void Daemon::onNewConnection()
+{
+    while (QLocalSocket * socket = server->nextPendingConnection()) {
+        const quint64 connection = ++lastConnection;
+        socket->setProperty("connection", connection);
+        connections.insert(connection, socket);
+        connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+        connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+    }
+}
+
+void Daemon::onReadyRead()
+{
+    QLocalSocket * socket = qobject_cast<QLocalSocket *>(sender());
+    if (!socket) return;
+    const quint64 connection = socket->property("connection").toULongLong();
+    while (socket->canReadLine()) {
+        const QByteArray line = socket->readLine().trimmed();
+        if (line.isEmpty()) continue;
+        QJsonParseError error;
+        const QJsonDocument document = QJsonDocument::fromJson(line, &error);
+        if (!document.isObject()) {
+            const QJsonObject reply = failure(QJsonObject(), "Malformed request: " + error.errorString());
+            sendReply(connection, QJsonDocument(reply).toJson(QJsonDocument::Compact));
+            continue;
+        }
+        const QJsonObject request = document.object();
+        pool.start(new RequestTask([this, connection, request]() {
+            emit replyReady(connection, QJsonDocument(process(request)).toJson(QJsonDocument::Compact));
+        }));
+    }
+    if (socket->bytesAvailable() > MAX_REQUEST_BYTES) {
+        qWarning() << "Dropping a connection with a request over" << MAX_REQUEST_BYTES << "bytes";
+        connections.remove(connection);
+        socket->disconnect(this);
+        socket->abort();
+        socket->deleteLater();
+    }
+}
+
+void Daemon::onDisconnected()
+{
+    QLocalSocket * socket = qobject_cast<QLocalSocket *>(sender());
+    if (!socket) return;
+    connections.remove(socket->property("connection").toULongLong());
+    socket->deleteLater();
+}
+
+//Answers of closed connections are dropped
+void Daemon::sendReply(quint64 connection, const QByteArray& reply)
+{
+    QLocalSocket * socket = connections.value(connection);
+    if (!socket) return;
+    socket->write(reply);
+    socket->write("\n");
+}
+
+//Runs on the pool. A cached image skips decoding and construction, and the
+//threshold of a repeated page comes from the rank cache of the image.
+QJsonObject Daemon::process(const QJsonObject& request)
+{
+    PROFILE_FUNCTION();
+    QElapsedTimer timer;
+    timer.start();
+    QJsonObject reply;
+    reply["id"] = request["id"];
+
+    const QString op = request["op"].toString();
+    const QSize size(request["width"].toInt(), request["height"].toInt());
+    if (op != "page" && op != "resize") return failure(reply, "Unknown op: " + op);
+    if (op == "resize" && (size.width() < 3 || size.height() < 3))
+        return failure(reply, "Incorrect size");
+
+    const QString source = request["source"].toString();
+    QFile file(source);
+    if (!file.open(QIODevice::ReadOnly)) return failure(reply, "Unable to read " + source);
+    const QByteArray data = file.readAll();
+    const QByteArray key = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+
+    const QSharedPointer<ImageCache::Entry> entry = cache.entry(key);
+    bool isCached = true;
+    QImage result;
+    qint64 cost = 0;
+    try {
+        QMutexLocker locker(&entry->mutex);
+        if (!entry->image) {
+            isCached = false;
+            //The cost is reserved before decoding, images built side by side
+            //would overshoot the capacity otherwise
+            QBuffer buffer;
+            buffer.setData(data);
+            QImageReader reader(&buffer);
+            const QSize decodedSize = reader.size();
+            if (decodedSize.isValid())
+                cache.setCost(key, ESTIMATED_BYTES_PER_PIXEL * decodedSize.width() * decodedSize.height());
+            const QImage image = reader.read();
+            if (image.isNull()) {
+                locker.unlock();
+                cache.remove(key);
+                return failure(reply, "Unable to decode " + source);
+            }
+            if (!decodedSize.isValid())
+                cache.setCost(key, ESTIMATED_BYTES_PER_PIXEL * image.width() * image.height());
+            entry->image.reset(new DtwImage(image));
+        }
+        result = (op == "page") ? entry->image->makeColoringPage(request["details"].toInt())
+                                : entry->image->resize(size);
+        const DtwImage::Statistics stats = entry->image->statistics();
+        cost = stats.colorBytes + stats.cellBytes + stats.cacheBytes;
+    } catch (const std::exception& e) {
+        cache.remove(key);
+        return failure(reply, QString("Unable to convert ") + source + ": " + e.what());
+    }
+    cache.setCost(key, cost);
+
+    const QString destination = request["destination"].toString();
+    if (!result.save(destination)) return failure(reply, "Unable to save " + destination);
+
+    reply["ok"] = true;
+    reply["cached"] = isCached;
+    reply["ms"] = timer.nsecsElapsed() / 1e6;
+    return reply;
+}
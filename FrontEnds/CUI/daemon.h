@@ -0,0 +1,103 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QThreadPool>
+
+#include "dtwimage.h"
+
+class QLocalServer;
+class QLocalSocket;
+
+//Recently used images keyed by the hash of their file contents. The least
+//recently used ones are dropped once the memory of all of them is over the
+//capacity; requests still holding a dropped entry keep it alive.
+class ImageCache {
+public:
+    struct Entry {
+        QMutex mutex;   //DtwImage keeps mutable caches, one request at a time
+        QScopedPointer<dtw::DtwImage> image;
+    };
+
+    explicit ImageCache(qint64 capacity);
+
+    //The entry of "key", a new one without an image when it is missing
+    QSharedPointer<Entry> entry(const QByteArray& key);
+    void remove(const QByteArray& key);
+    //Updates the memory taken by "key", then drops old entries beyond the capacity.
+    //Images being built reserve an estimate first, so they count as well.
+    void setCost(const QByteArray& key, qint64 cost);
+
+private:
+    QMutex mutex;
+    qint64 capacity;
+    qint64 total;
+    QHash<QByteArray, QSharedPointer<Entry>> entries;
+    QHash<QByteArray, qint64> costs;
+    QList<QByteArray> order;    //most recently used first
+};
+
+//Serves coloring pages and resizes on a local socket, one JSON request per line:
+//  {"id": 1, "op": "page", "source": "in.jpg", "destination": "out.png", "details": 30}
+//  {"id": 2, "op": "resize", "source": "in.jpg", "destination": "out.png", "width": 640, "height": 480}
+//Each one is answered by a line {"id": 1, "ok": true, "cached": true, "ms": 12.5}
+//or {"id": 1, "ok": false, "error": "..."}. Requests run concurrently, so the
+//answers of one connection may come out of order.
+class Daemon : public QObject
+{
+    Q_OBJECT
+
+public:
+    Daemon(int jobs, qint64 cacheBytes, QObject * parent = 0);
+    ~Daemon();
+
+    //Fails when another daemon already serves "name"
+    bool listen(const QString& name);
+    QString errorString() const;
+
+signals:
+    void replyReady(quint64 connection, const QByteArray& reply);
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onDisconnected();
+    void sendReply(quint64 connection, const QByteArray& reply);
+
+private:
+    QLocalServer * server;
+    QThreadPool pool;
+    ImageCache cache;
+    quint64 lastConnection;
+    QHash<quint64, QLocalSocket *> connections;
+    QString listenError;
+
+    QJsonObject process(const QJsonObject& request);
+};
+
+#endif // DAEMON_H
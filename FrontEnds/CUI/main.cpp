@@ -19,8 +19,12 @@
 #include <QCoreApplication>
 #include <QCommandLineParser>
 #include <QDebug>
+#include <QThread>
 
+#include "batch.h"
+#include "daemon.h"
 #include "dtwimage.h"
+#include "dtwprofiler.h"
 
 int main(int argc, char *argv[])
 {
@@ -32,24 +36,98 @@ int main(int argc, char *argv[])
     parser.setApplicationDescription(QCoreApplication::translate("main", "Painting page creator"));
     parser.addHelpOption();
     parser.addVersionOption();
-    parser.addPositionalArgument("source", QCoreApplication::translate("main", "Source image file name"));
-    parser.addPositionalArgument("destination", QCoreApplication::translate("main", "Destination image file name"));
+    parser.addPositionalArgument("source", QCoreApplication::translate("main",
+                                 "Source image file name, directory or wildcard pattern"));
+    parser.addPositionalArgument("destination", QCoreApplication::translate("main",
+                                 "Destination image file name, or directory for many images"));
 
     QCommandLineOption detailsOption ( QStringList() << "d" << "details",
-                                       QCoreApplication::translate("main", "detalization level"),
+                                       QCoreApplication::translate("main", "detalization level, or a comma separated list of them; "
+                                                                           "a %1 in the destination is replaced by the level"),
                                        "details", "0" );
     parser.addOption(detailsOption);
 
+    //Batch mode
+    QCommandLineOption listOption ( QStringList() << "l" << "list",
+                                    QCoreApplication::translate("main", "source is a file listing one image per line, - for stdin") );
+    QCommandLineOption recursiveOption ( QStringList() << "r" << "recursive",
+                                         QCoreApplication::translate("main", "walk subdirectories of a source directory") );
+    QCommandLineOption formatOption ( QStringList() << "f" << "format",
+                                      QCoreApplication::translate("main", "file extension of batch destinations, the source one by default"),
+                                      "suffix" );
+    QCommandLineOption jobsOption ( QStringList() << "j" << "jobs",
+                                    QCoreApplication::translate("main", "images converted at the same time"),
+                                    "jobs", QString::number(QThread::idealThreadCount()) );
+    QCommandLineOption inFlightOption ( "in-flight",
+                                        QCoreApplication::translate("main", "images held in memory at most, twice the jobs by default"),
+                                        "images", "0" );
+    parser.addOption(listOption);
+    parser.addOption(recursiveOption);
+    parser.addOption(formatOption);
+    parser.addOption(jobsOption);
+    parser.addOption(inFlightOption);
+
+    //Daemon mode
+    QCommandLineOption daemonOption ( "daemon",
+                                      QCoreApplication::translate("main", "serve JSON requests on a local socket instead, one per line"),
+                                      "socket" );
+    QCommandLineOption cacheOption ( "cache-mb",
+                                     QCoreApplication::translate("main", "memory of the images the daemon keeps, in megabytes"),
+                                     "megabytes", "1024" );
+    parser.addOption(daemonOption);
+    parser.addOption(cacheOption);
+
     // Process the actual command line arguments given by the user
     parser.process(app);
 
+    const int jobs = qMax(1, parser.value(jobsOption).toInt());
+    if (parser.isSet(daemonOption))
+    {
+        Daemon daemon(jobs, parser.value(cacheOption).toLongLong() << 20);
+        if (!daemon.listen(parser.value(daemonOption)))
+        {
+            qCritical() << "Unable to listen on" << parser.value(daemonOption) << ":" << daemon.errorString();
+            exit(1);
+        }
+        return app.exec();
+    }
+
     const QStringList args = parser.positionalArguments();
     // source is args.at(0), destination is args.at(1)
 
     //If the number of arguments is incorrect show help and exit
     if (args.size()!=2) parser.showHelp(1);
 
-    int details = parser.value(detailsOption).toInt();
+    QList<int> details;
+    foreach (const QString& level, parser.value(detailsOption).split(',', QString::SkipEmptyParts))
+    {
+        bool isNumber;
+        details.append(level.toInt(&isNumber));
+        if (!isNumber)
+        {
+            qCritical() << "Incorrect detalization level:" << level;
+            exit(1);
+        }
+    }
+    if (details.isEmpty()) details.append(0);
+
+    PROFILE_SCOPE("CUI main");
+    if (parser.isSet(listOption) || isBatchSource(args.at(0)))
+    {
+        const QList<BatchItem> items = collectBatch(args.at(0), parser.isSet(listOption),
+                                                    parser.isSet(recursiveOption),
+                                                    args.at(1), parser.value(formatOption));
+        if (items.isEmpty())
+        {
+            qCritical() << "No source images found:" << args.at(0);
+            exit(1);
+        }
+        if (!hasDistinctDestinations(items)) exit(1);
+        const int inFlight = parser.value(inFlightOption).toInt();
+        const int failures = runBatch(items, details, jobs, (inFlight > 0) ? inFlight : 2 * jobs);
+        qInfo() << "Converted" << items.size() - failures << "of" << items.size() << "images";
+        exit(failures > 0 ? 1 : 0);
+    }
 
     QImage img;
     if (!img.load(args.at(0)))
@@ -58,7 +136,11 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    //Every level comes from the same energies and rank cache
     dtw::DtwImage dtwImage(img);
-    dtwImage.makeColoringPage(details).save(args.at(1));
+    QStringList names;
+    foreach (const int level, details)
+        names.append(detailFileName(args.at(1), level, details.size() > 1));
+    if (savePages(dtwImage.makeColoringPages(details), names) > 0) exit(1);
 
 }
@@ -31,19 +31,33 @@
 #include <QPrintDialog>
 #include <QPainter>
 #include <QPrinter>
+#include <QtConcurrent>
 #include <QtDebug>
 
+#include <stdexcept>
+
+//Detail changes closer than this are computed once
+static const int DETAILS_DEBOUNCE_MS = 150;
+
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
-    imageLabel(nullptr),
-    originalPixmap(),
-    dtwImage(nullptr),
+    imageView(nullptr),
+    originalImage(),
+    dtwImage(),
+    isPageOutdated(false),
+    coloringPageDetails(-1),
     scaleFactor(0.0)
 {
     ui->setupUi(this);
 
-    ui->scrollArea->setWidget(imageLabel = new QLabel());
+    detailsTimer.setSingleShot(true);
+    detailsTimer.setInterval(DETAILS_DEBOUNCE_MS);
+    connect(&detailsTimer, SIGNAL(timeout()), this, SLOT(requestColoringPage()));
+    connect(&loadWatcher, SIGNAL(finished()), this, SLOT(onImageLoaded()));
+    connect(&pageWatcher, SIGNAL(finished()), this, SLOT(onColoringPageReady()));
+
+    ui->scrollArea->setWidget(imageView = new TiledView());
 
 #if defined(QT_NO_PRINTER) || defined(QT_NO_PRINTDIALOG)
     ui->printButton->setHidden(true);
@@ -58,56 +72,124 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
-    if (dtwImage != nullptr) delete dtwImage;
     delete ui;
 }
 
+//The original is shown at once, the DtwImage is built in the background
 void MainWindow::loadImage(const QImage &image)
 {
-    originalPixmap = QPixmap::fromImage(image);
-    if (dtwImage != nullptr) delete dtwImage;
-    dtwImage = new dtw::DtwImage(image);
+    originalImage = image;
+    dtwImage.clear();
+    coloringPage = QImage();
+    coloringPageDetails = -1;
+    //A page of the previous image still running is dropped when it finishes
+    isPageOutdated = pageWatcher.isRunning();
     scaleFactor = 0.0;
-    displayModeToggled(true);
+    displayImage(originalImage);
+    ui->statusBar->showMessage(tr("Analyzing the image..."));
+    loadWatcher.setFuture(QtConcurrent::run([image]() -> QSharedPointer<dtw::DtwImage> {
+        try {
+            return QSharedPointer<dtw::DtwImage>(new dtw::DtwImage(image));
+        } catch (const std::exception&) {
+            return QSharedPointer<dtw::DtwImage>();
+        }
+    }));
+}
+
+void MainWindow::onImageLoaded()
+{
+    dtwImage = loadWatcher.result();
+    ui->statusBar->clearMessage();
+    if (dtwImage.isNull()) {
+        QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
+                                 tr("The image is too small."));
+        return;
+    }
+    //A page of the previous image may still be running
+    isPageOutdated = pageWatcher.isRunning();
+    if (!ui->originalButton->isChecked())
+        displayModeToggled(true);
+}
+
+void MainWindow::requestColoringPage()
+{
+    const QString drawingMessage = tr("Drawing the coloring page...");
+    if (dtwImage.isNull()) {
+        //onImageLoaded() asks again once the image is analyzed
+        if (ui->statusBar->currentMessage() == drawingMessage)
+            ui->statusBar->clearMessage();
+        return;
+    }
+    if (pageWatcher.isRunning()) {
+        isPageOutdated = true;
+        return;
+    }
+    isPageOutdated = false;
+    const QSharedPointer<dtw::DtwImage> image = dtwImage;
+    const int details = ui->detailsSpinBox->value();
+    coloringPageDetails = details;
+    ui->statusBar->showMessage(drawingMessage);
+    pageWatcher.setFuture(QtConcurrent::run([image, details]() {
+        return image->makeColoringPage(details);
+    }));
+}
+
+//An outdated page is dropped, the one on screen stays until the latest is ready
+void MainWindow::onColoringPageReady()
+{
+    if (isPageOutdated) {
+        requestColoringPage();
+        return;
+    }
+    ui->statusBar->clearMessage();
+    coloringPage = pageWatcher.result();
+    if (ui->coloringPageButton->isChecked())
+        displayImage(coloringPage);
 }
 
-void MainWindow::displayPixmap(const QPixmap &pixmap)
+//The view renders only what is visible, at the pyramid level nearest the zoom
+void MainWindow::displayImage(const QImage &image)
 {
+    displayedImage = image;
+    imageView->setImage(image);
     if (scaleFactor == 0.0) {
-        const int wScale = ui->scrollArea->size().width()*100 / pixmap.size().width();
-        const int hScale = ui->scrollArea->size().height()*100 / pixmap.size().height();
-        const int scale = qMin(wScale,hScale);
-        ui->zoomSpinBox->setValue(scale);
+        const int wScale = ui->scrollArea->size().width()*100 / image.size().width();
+        const int hScale = ui->scrollArea->size().height()*100 / image.size().height();
+        const int scale = qMax(1, qMin(wScale,hScale));
         ui->zoomSpinBox->setMinimum(scale);
         ui->zoomSlider->setMinimum(scale);
+        ui->zoomSpinBox->setValue(scale);
+        scaleFactor = scale / 100.0;
     }
-    QSize size = pixmap.size()*scaleFactor;
-    imageLabel->setPixmap(pixmap.scaled(size));
+    imageView->setScale(scaleFactor);
     #ifdef QT_DEBUG
     ui->statusBar->showMessage("scaleFactor = " + QString::number(scaleFactor));
     #endif
-    imageLabel->show();
-    displayedPixmap = pixmap;
 }
 
 void MainWindow::displayModeToggled(bool checked)
 {
-    if(!checked || dtwImage == nullptr) return;
+    if(!checked || originalImage.isNull()) return;
 
     if (ui->originalButton->isChecked())
-        displayPixmap(originalPixmap);
-    else if (ui->coloringPageButton->isChecked())
-        displayPixmap(QPixmap::fromImage(dtwImage->makeColoringPage(ui->detailsSpinBox->value())));
+        displayImage(originalImage);
+    else if (ui->coloringPageButton->isChecked()) {
+        if (!coloringPage.isNull() && coloringPageDetails == ui->detailsSpinBox->value()
+            && !pageWatcher.isRunning())
+            displayImage(coloringPage);
+        else
+            requestColoringPage();
+    }
 #ifdef QT_DEBUG
-    else if (ui->energyButton->isChecked())
-        displayPixmap(QPixmap::fromImage(dtwImage->dumpEnergy()));
+    else if (ui->energyButton->isChecked() && !dtwImage.isNull())
+        displayImage(dtwImage->dumpEnergy());
 #endif
 }
 
-void MainWindow::onDetailRatioChanged(int newPercent)
+void MainWindow::onDetailRatioChanged(int)
 {
-    if (dtwImage != nullptr && ui->coloringPageButton->isChecked())
-        displayPixmap(QPixmap::fromImage(dtwImage->makeColoringPage(newPercent)));
+    if (ui->coloringPageButton->isChecked())
+        detailsTimer.start();
 }
 
 static void adjustScrollBar(QScrollBar *scrollBar, double factor)
@@ -119,10 +201,11 @@ static void adjustScrollBar(QScrollBar *scrollBar, double factor)
 void MainWindow::onZoomChanged(int newPercent)
 {
     const double newScale = newPercent / 100.0;
-    adjustScrollBar(ui->scrollArea->horizontalScrollBar(), newScale / scaleFactor);
-    adjustScrollBar(ui->scrollArea->verticalScrollBar(), newScale / scaleFactor);
+    const double factor = (scaleFactor > 0.0) ? newScale / scaleFactor : 1.0;
     scaleFactor = newScale;
-    displayPixmap(displayedPixmap);
+    imageView->setScale(scaleFactor);
+    adjustScrollBar(ui->scrollArea->horizontalScrollBar(), factor);
+    adjustScrollBar(ui->scrollArea->verticalScrollBar(), factor);
 }
 
 void MainWindow::on_loadButton_clicked()
@@ -150,8 +233,7 @@ bool MainWindow::loadFile(const QString &fileName)
         QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
                                  tr("Cannot load %1.").arg(QDir::toNativeSeparators(fileName)));
         setWindowFilePath(QString());
-        imageLabel->setPixmap(QPixmap());
-        imageLabel->adjustSize();
+        imageView->setImage(QImage());
         return false;
     }
 
@@ -168,11 +250,11 @@ void MainWindow::on_printButton_clicked()
     if (dialog.exec()) {
         QPainter painter(&printer);
         QRect rect = painter.viewport();
-        QSize size = displayedPixmap.size();
+        QSize size = displayedImage.size();
         size.scale(rect.size(), Qt::KeepAspectRatio);
         painter.setViewport(rect.x(), rect.y(), size.width(), size.height());
-        painter.setWindow(displayedPixmap.rect());
-        painter.drawPixmap(0, 0, displayedPixmap);
+        painter.setWindow(displayedImage.rect());
+        painter.drawImage(0, 0, displayedImage);
     }
 #endif
 }
@@ -201,7 +283,7 @@ bool MainWindow::saveFile(const QString &fileName)
                                  tr("Cannot write file %1.").arg(QDir::toNativeSeparators(fileName)));
         return false;
     }
-    writer.write(displayedPixmap.toImage());
+    writer.write(displayedImage);
     ui->statusBar->showMessage("Saved to file : " +  QDir::toNativeSeparators(fileName));
     return true;
 }
@@ -20,11 +20,14 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QFutureWatcher>
 #include <QImage>
-#include <QLabel>
+#include <QSharedPointer>
 #include <QString>
+#include <QTimer>
 
 #include "dtwimage.h"
+#include "tiledview.h"
 
 
 namespace Ui {
@@ -54,18 +57,31 @@ private slots:
 
     void on_saveButton_clicked();
 
+    void onImageLoaded();
+    void onColoringPageReady();
+    void requestColoringPage();
+
 private:
     Ui::MainWindow *ui;    
-    QLabel * imageLabel;
-
-    QPixmap originalPixmap;
-    QPixmap displayedPixmap;
-
-    dtw::DtwImage *dtwImage;
+    TiledView * imageView;
+
+    QImage originalImage;
+    QImage displayedImage;
+
+    //Built and used on worker threads, which keep their own reference
+    QSharedPointer<dtw::DtwImage> dtwImage;
+    QFutureWatcher<QSharedPointer<dtw::DtwImage>> loadWatcher;
+    //One coloring page is computed at a time, newer requests only mark it
+    //outdated and the latest one runs when it finishes
+    QFutureWatcher<QImage> pageWatcher;
+    bool isPageOutdated;
+    QImage coloringPage;
+    int coloringPageDetails;
+    QTimer detailsTimer;
 
     double scaleFactor;
 
-    void displayPixmap(const QPixmap& image);
+    void displayImage(const QImage& image);
     bool loadFile(const QString &fileName);
     bool saveFile(const QString &fileName);
 
@@ -0,0 +1,112 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#include "tiledview.h"
+
+#include <QPainter>
+#include <QPaintEvent>
+
+static const int TILE_SIZE = 256;
+//Cost of the tile cache is counted in kilobytes
+static const int TILE_CACHE_KB = 64 * 1024;
+
+TiledView::TiledView(QWidget *parent)
+    : QWidget(parent),
+      scaleFactor(1.0),
+      tiles(TILE_CACHE_KB)
+{
+    setAttribute(Qt::WA_OpaquePaintEvent);
+}
+
+void TiledView::setImage(const QImage& image)
+{
+    if (image.cacheKey() == source.cacheKey()) return;
+    source = image;
+    levels.clear();
+    tiles.clear();
+    setFixedSize(source.size() * scaleFactor);
+    update();
+}
+
+void TiledView::setScale(double scale)
+{
+    if (scale <= 0.0 || scale == scaleFactor) return;
+    scaleFactor = scale;
+    tiles.clear();
+    setFixedSize(source.size() * scaleFactor);
+    update();
+}
+
+//Level 0 shares the source, coarser levels are made once per image
+const QImage& TiledView::level(int k)
+{
+    if (levels.isEmpty()) levels.append(source);
+    while (levels.size() <= k) {
+        const QImage coarser = levels.last().scaled(qMax(1, levels.last().width() / 2),
+                                                    qMax(1, levels.last().height() / 2),
+                                                    Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        levels.append(coarser);
+    }
+    return levels.at(k);
+}
+
+QPixmap TiledView::renderTile(const QRect& target)
+{
+    //The coarsest level that still has a pixel for every pixel on screen
+    int k = 0;
+    const int smallest = qMin(source.width(), source.height());
+    while (scaleFactor * (2 << k) <= 1.0 && (smallest >> (k + 1)) > 0)
+        k++;
+    const QImage& image = level(k);
+    const double sx = double(image.width()) / source.width() / scaleFactor;
+    const double sy = double(image.height()) / source.height() / scaleFactor;
+    const QRectF sourceRect(target.x() * sx, target.y() * sy, target.width() * sx, target.height() * sy);
+
+    QImage tile(target.size(), QImage::Format_ARGB32_Premultiplied);
+    tile.fill(palette().color(QPalette::Window));
+    QPainter painter(&tile);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    painter.drawImage(QRectF(QPointF(0.0, 0.0), QSizeF(target.size())), image, sourceRect);
+    painter.end();
+    return QPixmap::fromImage(tile);
+}
+
+void TiledView::paintEvent(QPaintEvent *event)
+{
+    QPainter painter(this);
+    const QRect exposed = event->rect() & rect();
+    if (source.isNull() || exposed.isEmpty()) {
+        painter.fillRect(event->rect(), palette().window());
+        return;
+    }
+
+    for (int row = exposed.top() / TILE_SIZE; row <= exposed.bottom() / TILE_SIZE; row++) {
+        for (int column = exposed.left() / TILE_SIZE; column <= exposed.right() / TILE_SIZE; column++) {
+            const QRect target = QRect(column * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE) & rect();
+            const quint64 key = (quint64(row) << 32) | quint32(column);
+            QPixmap tile;
+            if (const QPixmap * cached = tiles.object(key)) {
+                tile = *cached;
+            } else {
+                tile = renderTile(target);
+                tiles.insert(key, new QPixmap(tile), tile.width() * tile.height() * 4 / 1024 + 1);
+            }
+            painter.drawPixmap(target.topLeft(), tile);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#ifndef TILEDVIEW_H
+#define TILEDVIEW_H
+
+#include <QCache>
+#include <QImage>
+#include <QPixmap>
+#include <QVector>
+#include <QWidget>
+
+//Shows an image of any size at any zoom. A paint only renders the tiles
+//inside the exposed area, each from the level of a mip pyramid nearest
+//above the zoom, so its cost does not depend on the image size.
+//Rendered tiles of the current zoom are cached for panning.
+class TiledView : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit TiledView(QWidget *parent = 0);
+
+    void setImage(const QImage& image);
+    const QImage& image() const { return source; }
+
+    void setScale(double scale);
+    double scale() const { return scaleFactor; }
+
+protected:
+    void paintEvent(QPaintEvent *event);
+
+private:
+    QImage source;
+    QVector<QImage> levels;   //levels[k] is the source halved k times, made on demand
+    double scaleFactor;
+    QCache<quint64, QPixmap> tiles;
+
+    const QImage& level(int k);
+    QPixmap renderTile(const QRect& target);
+};
+
+#endif // TILEDVIEW_H
@@ -0,0 +1,34 @@
+#
+#    Dye The World Project
+#    Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU Affero General Public License as
+#    published by the Free Software Foundation, either version 3 of the
+#    License, or (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU Affero General Public License for more details.
+#
+#    You should have received a copy of the GNU Affero General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#Synthetic corpus benchmark, see "dtwbench --help".
+#"dtwbench -o new.json --baseline old.json" fails on regressions.
+
+VERSION = 0.0.1
+
+QT       += core gui
+
+TARGET = dtwbench
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+
+SOURCES += main.cpp
+
+include(../../DyeTheWorld.pri)
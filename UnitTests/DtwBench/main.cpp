@@ -0,0 +1,305 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QScopedPointer>
+
+#include <cmath>
+#include <functional>
+
+#include "dtwimage.h"
+
+using namespace dtw;
+
+//Megapixels of the corpus, --max-mp cuts it
+static const double SIZES[] = { 0.1, 0.5, 2.0, 8.0, 20.0, 50.0 };
+static const int DETAILS[] = { 5, 20, 50 };
+//Growing and transposing cost seconds per megapixel, larger images skip them
+static const double MAX_GROW_MP = 0.5;
+
+//Edge density of a synthetic picture: "smooth" is shading without edges,
+//"blocks" flat tiles with sharp borders, "noisy" tiles under a fine texture
+struct Texture {
+    const char * name;
+    int block;
+    int noise;
+};
+static const Texture TEXTURES[] = { { "smooth", 0, 0 }, { "blocks", 48, 0 }, { "noisy", 16, 96 } };
+
+static inline quint32 hash(quint32 x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static inline int clampChannel(int c)
+{
+    return qBound(0, c, 255);
+}
+
+//The same picture for the same arguments on every platform
+static QImage synthesize(const Texture& texture, const QSize& size)
+{
+    QImage image(size, DtwImage::DTW_FORMAT);
+    const int width = size.width();
+    const int height = size.height();
+    for (int y = 0; y < height; y++) {
+        QRgb * const line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < width; x++) {
+            int r, g, b;
+            if (texture.block > 0) {
+                const quint32 tile = hash(quint32(x / texture.block) * 40503u ^ quint32(y / texture.block));
+                r = tile & 0xff;
+                g = (tile >> 8) & 0xff;
+                b = (tile >> 16) & 0xff;
+            } else {
+                r = 255 * x / width;
+                g = 255 * y / height;
+                b = 255 * (x + y) / (width + height);
+            }
+            if (texture.noise > 0) {
+                const quint32 n = hash(quint32(y) * quint32(width) + quint32(x));
+                r += int(n & 0xff) * texture.noise / 256 - texture.noise / 2;
+                g += int((n >> 8) & 0xff) * texture.noise / 256 - texture.noise / 2;
+                b += int((n >> 16) & 0xff) * texture.noise / 256 - texture.noise / 2;
+            }
+            line[x] = qRgb(clampChannel(r), clampChannel(g), clampChannel(b));
+        }
+    }
+    return image;
+}
+
+static QSize sizeOf(double megapixels)
+{
+    const int width = qRound(std::sqrt(megapixels * 1e6 * 4 / 3));
+    return QSize(width, qRound(megapixels * 1e6 / width));
+}
+
+//Best wall time of "repeat" runs in milliseconds, "prepare" is not timed
+static double measure(int repeat, const std::function<void()>& prepare, const std::function<void()>& body)
+{
+    double best = 0.0;
+    for (int i = 0; i < repeat; i++) {
+        prepare();
+        QElapsedTimer timer;
+        timer.start();
+        body();
+        const double ms = timer.nsecsElapsed() / 1e6;
+        if (i == 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+//"budgetMs" is the most the operation may take, 0 if it has no budget
+static QJsonObject result(const QString& image, const QSize& size, const QString& operation, double ms,
+                          double budgetMs = 0.0)
+{
+    QJsonObject object;
+    object["image"] = image;
+    object["width"] = size.width();
+    object["height"] = size.height();
+    object["operation"] = operation;
+    object["ms"] = ms;
+    if (budgetMs > 0.0) object["budgetMs"] = budgetMs;
+    qInfo().noquote() << image << operation << QString::number(ms, 'f', 2) << "ms";
+    return object;
+}
+
+//Resize budgets are in milliseconds per megapixel of the larger of the two
+//sizes, about three times what a release build needs. "scale" loosens them
+//for debug builds and slow machines.
+static double resizeBudget(int msPerMegapixel, const QSize& from, const QSize& to, double scale)
+{
+    const qint64 pixels = qMax(qint64(from.width()) * from.height(), qint64(to.width()) * to.height());
+    return msPerMegapixel * scale * pixels / 1e6;
+}
+
+//True if every operation kept within its budget
+static bool checkBudgets(const QJsonArray& results)
+{
+    bool isOk = true;
+    foreach (const QJsonValue& value, results) {
+        const QJsonObject current = value.toObject();
+        const double budget = current["budgetMs"].toDouble();
+        if (budget > 0.0 && current["ms"].toDouble() > budget) {
+            qWarning().noquote() << "Over budget:" << current["image"].toString()
+                                 << current["operation"].toString()
+                                 << QString::number(current["ms"].toDouble(), 'f', 2) << "ms of"
+                                 << QString::number(budget, 'f', 2) << "ms";
+            isOk = false;
+        }
+    }
+    return isOk;
+}
+
+//Compares with the results of another build, true if nothing got slower
+//than the tolerance allows
+static bool compare(const QJsonArray& results, const QJsonArray& baseline, double tolerance)
+{
+    bool isOk = true;
+    foreach (const QJsonValue& value, results) {
+        const QJsonObject current = value.toObject();
+        foreach (const QJsonValue& baseValue, baseline) {
+            const QJsonObject base = baseValue.toObject();
+            if (base["image"] != current["image"] || base["operation"] != current["operation"])
+                continue;
+            const double ratio = current["ms"].toDouble() / qMax(base["ms"].toDouble(), 1e-3);
+            if (ratio > 1.0 + tolerance / 100) {
+                qWarning().noquote() << "Regression:" << current["image"].toString()
+                                     << current["operation"].toString()
+                                     << QString::number(ratio, 'f', 2) << "x baseline";
+                isOk = false;
+            }
+        }
+    }
+    return isOk;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("DyeTheWorld benchmark");
+    QCoreApplication::setApplicationVersion(APP_VERSION);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Times the library on a synthetic image corpus");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    QCommandLineOption maxSizeOption("max-mp", "Largest image in megapixels, up to 50", "mp", "2");
+    QCommandLineOption repeatOption("repeat", "Runs of every operation, the best one counts", "count", "3");
+    QCommandLineOption backendOption("backend", "linked or dense", "backend", "linked");
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "JSON results file", "file");
+    QCommandLineOption baselineOption("baseline", "JSON results of another build to compare with", "file");
+    QCommandLineOption toleranceOption("tolerance", "Slowdown in percent reported as a regression", "percent", "10");
+    QCommandLineOption budgetScaleOption("budget-scale", "Factor applied to the resize budgets, 0 disables them",
+                                         "factor", "1");
+    parser.addOption(maxSizeOption);
+    parser.addOption(repeatOption);
+    parser.addOption(backendOption);
+    parser.addOption(outputOption);
+    parser.addOption(baselineOption);
+    parser.addOption(toleranceOption);
+    parser.addOption(budgetScaleOption);
+    parser.process(app);
+
+    const double maxSize = parser.value(maxSizeOption).toDouble();
+    const int repeat = qMax(1, parser.value(repeatOption).toInt());
+    const double budgetScale = parser.value(budgetScaleOption).toDouble();
+    const DtwImage::Backend backend = (parser.value(backendOption) == "dense")
+                                    ? DtwImage::DENSE_ROWS : DtwImage::LINKED_GRID;
+
+    QJsonArray results;
+    for (const double megapixels : SIZES) {
+        if (megapixels > maxSize) break;
+        const QSize size = sizeOf(megapixels);
+        for (const Texture& texture : TEXTURES) {
+            const QString name = QString("%1-%2MP").arg(texture.name).arg(megapixels);
+            const QImage source = synthesize(texture, size);
+
+            QScopedPointer<DtwImage> image;
+            results.append(result(name, size, "construct", measure(repeat,
+                [&]() { image.reset(); },
+                [&]() { image.reset(new DtwImage(source, backend)); })));
+
+            for (const int detail : DETAILS) {
+                //A fresh copy each run, the threshold cache would make it free
+                QScopedPointer<DtwImage> copy;
+                results.append(result(name, size, QString("coloring page %1%").arg(detail), measure(repeat,
+                    [&]() { copy.reset(new DtwImage(*image)); },
+                    [&]() { copy->makeColoringPage(detail); })));
+            }
+
+            //Budgets of 0 are not checked
+            const struct { const char * label; int delta; int widthBudget; int heightBudget; } shrinks[] = {
+                { "1px", 1, 0, 0 }, { "10%", 10, 0, 0 }, { "50%", 50, 2000, 2500 }
+            };
+            for (const auto& shrink : shrinks) {
+                const int dw = (shrink.delta == 1) ? 1 : size.width() * shrink.delta / 100;
+                const int dh = (shrink.delta == 1) ? 1 : size.height() * shrink.delta / 100;
+                const QSize narrower(size.width() - dw, size.height());
+                const QSize lower(size.width(), size.height() - dh);
+                results.append(result(name, size, QString("resize width -%1").arg(shrink.label), measure(repeat,
+                    []() {},
+                    [&]() { image->resize(narrower); }),
+                    resizeBudget(shrink.widthBudget, size, narrower, budgetScale)));
+                results.append(result(name, size, QString("resize height -%1").arg(shrink.label), measure(repeat,
+                    []() {},
+                    [&]() { image->resize(lower); }),
+                    resizeBudget(shrink.heightBudget, size, lower, budgetScale)));
+            }
+
+            const struct { const char * label; QSize target; int budget; } resizes[] = {
+                { "resize size -50%", size / 2, 3000 },
+                { "resize width x2", QSize(size.width() * 2, size.height()), 2500 },
+                { "resize height x2", QSize(size.width(), size.height() * 2), 3000 },
+                { "resize size x2", size * 2, 5000 },
+                { "resize transposed", size.transposed(), 2500 }
+            };
+            for (const auto& change : resizes) {
+                const bool isGrowing = change.target.width() > size.width()
+                                    || change.target.height() > size.height();
+                if (isGrowing && megapixels > MAX_GROW_MP) continue;
+                results.append(result(name, size, change.label, measure(repeat,
+                    []() {},
+                    [&]() { image->resize(change.target); }),
+                    resizeBudget(change.budget, size, change.target, budgetScale)));
+            }
+        }
+    }
+
+    QJsonObject report;
+    report["version"] = QCoreApplication::applicationVersion();
+    report["backend"] = parser.value(backendOption);
+    report["threads"] = DtwImage::maxThreadCount();
+    report["repeat"] = repeat;
+    report["results"] = results;
+    const QByteArray json = QJsonDocument(report).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+            qCritical() << "Unable to write" << parser.value(outputOption);
+            return 1;
+        }
+    }
+
+    if (parser.isSet(baselineOption)) {
+        QFile file(parser.value(baselineOption));
+        if (!file.open(QIODevice::ReadOnly)) {
+            qCritical() << "Unable to read" << parser.value(baselineOption);
+            return 1;
+        }
+        const QJsonArray baseline = QJsonDocument::fromJson(file.readAll()).object()["results"].toArray();
+        if (!compare(results, baseline, parser.value(toleranceOption).toDouble()))
+            return 2;
+    }
+    //Going over a budget is a regression as well
+    if (!checkBudgets(results))
+        return 2;
+    return 0;
+}
@@ -20,10 +20,31 @@
 #include <QtTest>
 
 #include "dtwimage.h"
-//#include "benchmark.h"
+#include "dtwimage_p.h"
+#include "dtwkernels.h"
+#include "dtwprofiler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
 
 using namespace dtw;
 
+#ifdef QT_DEBUG
+static const int DEBUG_SLOWDOWN = 6;
+#else
+static const int DEBUG_SLOWDOWN = 1;
+#endif
+
+//DTW_TIME_BUDGET_SCALE multiplies the time budgets for slow or loaded
+//machines, 0 turns them off
+static double timeBudgetScale()
+{
+    bool isNumber = false;
+    const double scale = qgetenv("DTW_TIME_BUDGET_SCALE").toDouble(&isNumber);
+    return isNumber ? scale : 1.0;
+}
+
 class dtwImageTest : public QObject
 {
     Q_OBJECT
@@ -35,7 +56,7 @@ private:
     QImage originalImage;
     DtwImage * dtwImage;
 
-    void resizeTest(const QSize& newSize);
+    void resizeTest(const QSize& newSize, int msPerMegapixel = 0, int bytesPerPixel = 0);
 
 private Q_SLOTS:
     void initTestCase();
@@ -61,6 +82,16 @@ private Q_SLOTS:
     void resizeTransposeTestCase();
 
     void makeColoringPageTestCase();
+    void makeColoringPagesTestCase();
+
+    void kernelsTestCase();
+    void parallelConstructionTestCase();
+    void seamsPerPassTestCase();
+    void denseBackendTestCase();
+    void pyramidSearchTestCase();
+    void thresholdTestCase();
+    void findContoursTestCase();
+    void statisticsTestCase();
 };
 
 dtwImageTest::dtwImageTest()
@@ -71,9 +102,8 @@ dtwImageTest::dtwImageTest()
 
 void dtwImageTest::initTestCase()
 {
-//    BENCHMARK_START();
+    PROFILE_SCOPE("dtwImageTest::initTestCase construction");
     dtwImage = new DtwImage(originalImage);
-//    BENCHMARK_STOP();
 #ifdef QT_DEBUG
     QImage dumpedImage = dtwImage->dumpImage();
     dumpedImage.save("dumpedImage.bmp");
@@ -101,14 +131,36 @@ void dtwImageTest::dumpHighEnergyTestCase() {
 
 #endif
 
-void dtwImageTest::resizeTest(const QSize& newSize)
+//Budgets are per megapixel of the larger of the two sizes: wall time in
+//milliseconds and the peak memory of the library in bytes per pixel.
+//The time budgets are several times what a release build needs, 0
+//disables a check. DtwBench checks the same time budgets on larger images.
+void dtwImageTest::resizeTest(const QSize& newSize, int msPerMegapixel, int bytesPerPixel)
 {
     QString filename = QString("resized_") + QString::number(newSize.width())
                         + "x" + QString::number(newSize.height()) + ".bmp";
+    dtwImage->resetStatistics();
+    QElapsedTimer timer;
+    timer.start();
     QImage resized = dtwImage->resize(newSize);
+    const qint64 elapsed = timer.elapsed();
     resized.save(filename);
     QVERIFY(resized.size() == newSize);
 
+    const qint64 pixels = qMax(qint64(newSize.width()) * newSize.height(),
+                               qint64(originalImage.width()) * originalImage.height());
+    const double timeScale = timeBudgetScale();
+    if (msPerMegapixel > 0 && timeScale > 0) {
+        const qint64 budget = qint64(msPerMegapixel * timeScale * DEBUG_SLOWDOWN * pixels / 1000000);
+        QVERIFY2(elapsed <= budget, qPrintable(QString("Resize to %1x%2 took %3 ms, the budget is %4 ms")
+                 .arg(newSize.width()).arg(newSize.height()).arg(elapsed).arg(budget)));
+    }
+    if (bytesPerPixel > 0) {
+        const qint64 peak = dtwImage->statistics().peakBytes;
+        const qint64 budget = bytesPerPixel * pixels;
+        QVERIFY2(peak <= budget, qPrintable(QString("Resize to %1x%2 peaked at %3 bytes, the budget is %4 bytes")
+                 .arg(newSize.width()).arg(newSize.height()).arg(peak).arg(budget)));
+    }
 }
 
 void dtwImageTest::decreaseWidthTestCase() {
@@ -120,50 +172,40 @@ void dtwImageTest::decreaseHeihtTestCase() {
 }
 
 void dtwImageTest::increaseWidthTestCase() {
-    QEXPECT_FAIL("","Not implemented yet", Continue);
     resizeTest(QSize(originalImage.size().width() + 1, originalImage.size().height()));
 }
 
 void dtwImageTest::increaseHeihtTestCase() {
-    QEXPECT_FAIL("","Not implemented yet", Continue);
     resizeTest(QSize(originalImage.size().width(), originalImage.size().height() + 1));
 }
 
 void dtwImageTest::resizeHalfWidthTestCase()
 {
-    QSKIP("Skiped due to bed performance");
-    resizeTest(QSize(originalImage.size().width()/2, originalImage.size().height()));
+    resizeTest(QSize(originalImage.size().width()/2, originalImage.size().height()), 2000, 64);
 }
 
 void dtwImageTest::resizeHalfHeightTestCase() {
-    QSKIP("Skiped due to bed performance");
-    resizeTest(QSize(originalImage.size().width(), originalImage.size().height()/2));
+    resizeTest(QSize(originalImage.size().width(), originalImage.size().height()/2), 2500, 64);
 }
 
 void dtwImageTest::resizeHalfSizeTestCase() {
-    QSKIP("Skiped due to bed performance");
-    resizeTest(originalImage.size()/2);
+    resizeTest(originalImage.size()/2, 3000, 64);
 }
 
 void dtwImageTest::resizeDoubleWidthTestCase() {
-    QSKIP("Skiped due to bed performance");
-    resizeTest(QSize(originalImage.size().width()*2, originalImage.size().height()));
+    resizeTest(QSize(originalImage.size().width()*2, originalImage.size().height()), 2500, 80);
 }
 
 void dtwImageTest::resizeDoubleHeightTestCase() {
-    QSKIP("Skiped due to bed performance");
-    resizeTest(QSize(originalImage.size().width(), originalImage.size().height()*2));
-
+    resizeTest(QSize(originalImage.size().width(), originalImage.size().height()*2), 3000, 80);
 }
 
 void dtwImageTest::resizeDoubleSizeTestCase() {
-    QSKIP("Skiped due to bed performance");
-    resizeTest(originalImage.size()*2);
+    resizeTest(originalImage.size()*2, 5000, 80);
 }
 
 void dtwImageTest::resizeTransposeTestCase() {
-    QSKIP("Skiped due to bed performance");
-    resizeTest(originalImage.size().transposed());
+    resizeTest(originalImage.size().transposed(), 2500, 96);
 }
 
 void dtwImageTest::makeColoringPageTestCase()
@@ -171,6 +213,218 @@ void dtwImageTest::makeColoringPageTestCase()
     QVERIFY(dtwImage->makeColoringPage().save("coloringPage.jpg"));
 }
 
+void dtwImageTest::makeColoringPagesTestCase()
+{
+    const QList<int> details = QList<int>() << 10 << 30 << 60;
+    const QList<QImage> pages = dtwImage->makeColoringPages(details);
+    QCOMPARE(pages.size(), details.size());
+    for (int i = 0; i < details.size(); i++)
+        QVERIFY(pages.at(i) == DtwImage(originalImage).makeColoringPage(details.at(i)));
+}
+
+//Every instruction set the CPU has must match the scalar code bit for bit
+void dtwImageTest::kernelsTestCase()
+{
+    //Widths cover the vector bodies and every tail length
+    for (int isa = kernels::ISA_SSE2; isa <= kernels::ISA_AVX512; isa++) {
+        const kernels::Isa variant = kernels::Isa(isa);
+        if (!kernels::isSupported(variant)) continue;
+        for (int width = 2; width <= 80; width++) {
+            QVector<QRgb> rows(3 * width);
+            QVector<double> energy(width);
+            QVector<quint16> ranks(width);
+            QVector<double> from(width);
+            for (int i = 0; i < rows.size(); i++)
+                rows[i] = 0xff000000u ^ (quint32(i) * 2654435761u);
+            for (int i = 0; i < width; i++) {
+                //Few distinct values, so ties are common
+                energy[i] = double((i * 7919) % 5);
+                ranks[i] = quint16((i * 104729) % 7);
+                from[i] = (i % 11 < 2) ? std::numeric_limits<double>::infinity() : double((i / 2) % 3);
+            }
+
+            QVector<double> scalarEnergy(width), vectorEnergy(width);
+            kernels::dualGradientRow(kernels::ISA_SCALAR, rows.constData(), rows.constData() + width,
+                                     rows.constData() + 2*width, width, scalarEnergy.data());
+            kernels::dualGradientRow(variant, rows.constData(), rows.constData() + width,
+                                     rows.constData() + 2*width, width, vectorEnergy.data());
+            QVERIFY(memcmp(scalarEnergy.constData(), vectorEnergy.constData(), width * sizeof(double)) == 0);
+
+            for (int rank = 0; rank < 8; rank++) {
+                QVector<uchar> scalarLine(width), vectorLine(width);
+                kernels::thresholdRow(kernels::ISA_SCALAR, ranks.constData(), energy.constData(), width,
+                                      rank, 2.0, scalarLine.data());
+                kernels::thresholdRow(variant, ranks.constData(), energy.constData(), width,
+                                      rank, 2.0, vectorLine.data());
+                QVERIFY(scalarLine == vectorLine);
+            }
+
+            for (int begin = 0; begin <= qMin(width, 3); begin++) {
+                for (int end = qMax(begin, width - 3); end <= width; end++) {
+                    QVector<double> scalarTo(width, -1.0), vectorTo(width, -1.0);
+                    QVector<qint8> scalarEdge(width, 2), vectorEdge(width, 2);
+                    kernels::seamRowSpan(kernels::ISA_SCALAR, from.constData(), energy.constData(), width,
+                                         begin, end, scalarTo.data(), scalarEdge.data());
+                    kernels::seamRowSpan(variant, from.constData(), energy.constData(), width,
+                                         begin, end, vectorTo.data(), vectorEdge.data());
+                    QVERIFY(memcmp(scalarTo.constData(), vectorTo.constData(), width * sizeof(double)) == 0);
+                    QVERIFY(scalarEdge == vectorEdge);
+                }
+            }
+        }
+    }
+}
+
+void dtwImageTest::parallelConstructionTestCase()
+{
+    const int threads = DtwImage::maxThreadCount();
+    const QSize newSize(originalImage.size().width() - 1, originalImage.size().height());
+    DtwImage::setMaxThreadCount(1);
+    DtwImage serial(originalImage);
+    DtwImage::setMaxThreadCount(8);
+    DtwImage parallel(originalImage);
+    DtwImage::setMaxThreadCount(threads);
+    QVERIFY(serial.resize(newSize) == parallel.resize(newSize));
+#ifdef QT_DEBUG
+    QVERIFY(serial.dumpImage() == parallel.dumpImage());
+#endif
+}
+
+static energy_t seamEnergy(const DtwImagePrivate& image, const Seam& seam)
+{
+    energy_t total = 0;
+    for (const index_t idx : seam)
+        total += image.cells.energy[idx];
+    return total;
+}
+
+//Energy of the vertical seams removed while narrowing "image" by "count"
+//columns, "perPass" seams at a time. Clears "isDisjoint" when two seams of
+//a pass share a cell.
+static energy_t removedEnergy(DtwImagePrivate& image, int count, int perPass, bool& isDisjoint)
+{
+    energy_t total = 0;
+    while (count > 0) {
+        const QList<Seam> seams = image.findVerticalSeams(qMin(count, perPass));
+        for (int n = 0; n < image.size.height(); n++) {
+            QSet<index_t> row;
+            foreach (const Seam& seam, seams) {
+                if (row.contains(seam[n])) isDisjoint = false;
+                row.insert(seam[n]);
+            }
+        }
+        foreach (const Seam& seam, seams) {
+            total += seamEnergy(image, seam);
+            image.removeVerticalSeam(seam);
+        }
+        count -= seams.size();
+    }
+    return total;
+}
+
+void dtwImageTest::seamsPerPassTestCase()
+{
+    const QSize newSize(originalImage.size().width() - 20, originalImage.size().height() - 20);
+    DtwImage batched(originalImage);
+    batched.setSeamsPerPass(8);
+    QVERIFY(batched.resize(newSize).size() == newSize);
+
+    //Twenty seams taken eight per pass cost 3.3% more energy than taken one
+    //per pass on the test image, the bound leaves room for other decoders
+    bool isDisjoint = true;
+    DtwImagePrivate exact(0, originalImage, DtwImage::LINKED_GRID);
+    DtwImagePrivate fast(0, originalImage, DtwImage::LINKED_GRID);
+    const energy_t exactEnergy = removedEnergy(exact, 20, 1, isDisjoint);
+    const energy_t fastEnergy = removedEnergy(fast, 20, 8, isDisjoint);
+    QVERIFY(isDisjoint);
+    QVERIFY2(fastEnergy <= 1.10 * exactEnergy,
+             qPrintable(QString("Batched seams cost %1, single ones %2").arg(fastEnergy).arg(exactEnergy)));
+}
+
+void dtwImageTest::denseBackendTestCase()
+{
+    const QSize newSize(originalImage.size().width() - 10, originalImage.size().height() - 10);
+    DtwImage linked(originalImage, DtwImage::LINKED_GRID);
+    DtwImage dense(originalImage, DtwImage::DENSE_ROWS);
+    QVERIFY(dense.backend() == DtwImage::DENSE_ROWS);
+    QVERIFY(linked.resize(newSize) == dense.resize(newSize));
+    dense.setSeamsPerPass(4);
+    QVERIFY(dense.resize(newSize).size() == newSize);
+}
+
+void dtwImageTest::pyramidSearchTestCase()
+{
+    const QSize newSize(originalImage.size().width() - 10, originalImage.size().height() - 10);
+    DtwImage exact(originalImage, DtwImage::LINKED_GRID);
+    DtwImage linked(originalImage, DtwImage::LINKED_GRID);
+    DtwImage dense(originalImage, DtwImage::DENSE_ROWS);
+    linked.setPyramidLevels(3);
+    dense.setPyramidLevels(3);
+    QVERIFY(dense.resize(newSize).size() == newSize);
+    //The linked grid keeps the exact search
+    QVERIFY(linked.resize(newSize) == exact.resize(newSize));
+
+    //Over ten seams, three levels cost 11% more energy than the exact seams
+    //of the same images on the test image, the bound leaves room for other
+    //decoders
+    DtwImagePrivate image(0, originalImage, DtwImage::DENSE_ROWS);
+    energy_t exactEnergy = 0;
+    energy_t pyramidEnergy = 0;
+    for (int i = 0; i < 10; i++) {
+        image.options.pyramidLevels = 1;
+        exactEnergy += seamEnergy(image, image.findVerticalSeam());
+        image.options.pyramidLevels = 3;
+        const Seam seam = image.findVerticalSeam();
+        pyramidEnergy += seamEnergy(image, seam);
+        image.removeVerticalSeam(seam);
+    }
+    QVERIFY2(pyramidEnergy <= 1.20 * exactEnergy,
+             qPrintable(QString("Pyramid seams cost %1, exact ones %2").arg(pyramidEnergy).arg(exactEnergy)));
+}
+
+//The rank histogram must pick the same energy as a full sort
+void dtwImageTest::thresholdTestCase()
+{
+    const QList<float> ratios = QList<float>() << 100.0f/1 << 20.0f << 10.0f << 100.0f/30
+                                               << 100.0f/60 << 100.0f/99 << 1.0f;
+    for (int backend = DtwImage::LINKED_GRID; backend <= DtwImage::DENSE_ROWS; backend++) {
+        const DtwImagePrivate image(0, originalImage, DtwImage::Backend(backend));
+        QVector<energy_t> sorted = image.cells.energy;
+        std::sort(sorted.begin(), sorted.end());
+        foreach (const float ratio, ratios) {
+            const int k = image.NM - image.NM/ratio;
+            QCOMPARE(image.getThresholdEnergy(ratio), sorted[k]);
+        }
+    }
+}
+
+void dtwImageTest::findContoursTestCase()
+{
+    const QList<QPolygon> contours = dtwImage->findContours();
+    QVERIFY(!contours.isEmpty());
+    const QRect bounds(QPoint(0, 0), originalImage.size());
+    foreach (const QPolygon& contour, contours) {
+        QVERIFY(contour.size() >= 3);
+        foreach (const QPoint& point, contour)
+            QVERIFY(bounds.contains(point));
+    }
+    DtwImage dense(originalImage, DtwImage::DENSE_ROWS);
+    QVERIFY(dense.findContours() == contours);
+}
+
+void dtwImageTest::statisticsTestCase()
+{
+    DtwImage image(originalImage);
+    QVERIFY(image.statistics().constructionTime > 0);
+    image.resetStatistics();
+    image.resize(QSize(originalImage.size().width() - 5, originalImage.size().height() - 3));
+    const DtwImage::Statistics stats = image.statistics();
+    QCOMPARE(stats.seamsRemoved, 8);
+    QVERIFY(stats.seamsFound >= stats.seamsRemoved);
+    QVERIFY(stats.seamSearchTime > 0 && stats.seamRemovalTime > 0);
+    QVERIFY(stats.colorBytes > 0 && stats.cellBytes > 0);
+}
+
 QTEST_APPLESS_MAIN(dtwImageTest)
 
 #include "tst_dtwimagetest.moc"
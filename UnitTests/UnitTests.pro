@@ -18,4 +18,5 @@
 
 TEMPLATE = subdirs
 CONFIG += ordered
-SUBDIRS = DtwImageTest
+SUBDIRS = DtwImageTest \
+          DtwBench
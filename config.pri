@@ -4,3 +4,6 @@ SUBDIRS += \
           "FrontEnds/WUI"
 
 DEFINES += BENCH
+#Counts the heap bytes of every profiling scope by wrapping the allocator
+#of the whole process
+#DEFINES += DTW_TRACE_ALLOCATIONS
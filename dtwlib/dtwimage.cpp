@@ -18,14 +18,17 @@
 
 #include "dtwimage.h"
 #include "dtwimage_p.h"
-
-#include <QQueue>
+#include "dtwkernels.h"
+#include "dtwparallel.h"
 
 #include <QDebug>
-#include "benchmark.h"
+#include "dtwprofiler.h"
 
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <limits>
+#include <utility>
 
 using namespace dtw;
 
@@ -33,6 +36,10 @@ const QImage::Format DtwImage::DTW_FORMAT = QImage::Format_ARGB32;
 
 static const index_t INVALID_INDEX = -1;
 static const int DEF_CONTOUR_RATIO = 20;
+static const int MIN_ROWS_PER_BAND = 16;
+static const int CONVERSION_STRIP = 64;
+static const int RANK_LEVELS = 1 << 16;
+static const int TRANSPOSE_TILE = 32;
 
 #ifdef DIAGONAL_NEIGHBOURS
 static const Directions UPPERS = { UP_LEFT, UP, UP_RIGHT };
@@ -41,6 +48,28 @@ static const Directions LEFTS = { UP_LEFT, LEFT, DOWN_LEFT };
 static const Directions RIGHTS = { UP_RIGHT, RIGHT, DOWN_RIGHT };
 #endif
 
+static inline Neighbour opposite(Neighbour dir) {
+    Q_ASSERT(dir == UP || dir == RIGHT || dir == DOWN || dir == LEFT);
+    return Neighbour((dir + 2) % 4);
+}
+
+//out[x*outStride + y] = in[y*inStride + x], tile by tile so that both
+//sides stay in cache
+template <typename T>
+static void transposeTiles(const T * in, int inStride, T * out, int outStride, int width, int height) {
+    parallel::forBands(height, TRANSPOSE_TILE, [&](int begin, int end) {
+        for (int y0 = begin; y0 < end; y0 += TRANSPOSE_TILE) {
+            const int yEnd = qMin(end, y0 + TRANSPOSE_TILE);
+            for (int x0 = 0; x0 < width; x0 += TRANSPOSE_TILE) {
+                const int xEnd = qMin(width, x0 + TRANSPOSE_TILE);
+                for (int y = y0; y < yEnd; y++)
+                    for (int x = x0; x < xEnd; x++)
+                        out[x*outStride + y] = in[y*inStride + x];
+            }
+        }
+    });
+}
+
 //static energy_t BORDER_ENERGY = std::numeric_limits<energy_t>::infinity();
 static energy_t BORDER_ENERGY = 1000.0;
 #ifdef QT_DEBUG
@@ -57,34 +86,129 @@ DtwImage::DtwImage(const DtwImage& dtw)
     Q_D(DtwImage);
 }
 
-DtwImage::DtwImage(const QImage& img) : d_ptr(new DtwImagePrivate(this, img))
+DtwImage::DtwImage(const QImage& img, Backend backend)
+    : d_ptr(new DtwImagePrivate(this, img, backend))
 {
     Q_D(DtwImage);
 }
 
+int DtwImage::maxThreadCount()
+{
+    return parallel::maxThreadCount();
+}
+
+void DtwImage::setMaxThreadCount(int count)
+{
+    parallel::setMaxThreadCount(count);
+}
+
 DtwImage::~DtwImage()
 {
     delete d_ptr;
 }
 
+DtwImage::Statistics::Statistics()
+    : constructionTime(0), energyTime(0), thresholdTime(0),
+      seamSearchTime(0), seamRemovalTime(0), seamInsertionTime(0), rasterizationTime(0),
+      seamSearches(0), seamsFound(0), seamsRemoved(0), seamsInserted(0),
+      colorBytes(0), cellBytes(0), cacheBytes(0), peakBytes(0)
+{}
+
+template <typename T>
+static qint64 bytes(const QVector<T>& v) {
+    return qint64(v.capacity()) * sizeof(T);
+}
+
+static qint64 bytes(const QImage& image) {
+    return qint64(image.bytesPerLine()) * image.height();
+}
+
+DtwImage::Statistics DtwImage::statistics() const
+{
+    Q_D(const DtwImage);
+    d->notePeakBytes();
+    Statistics stats = d->stats.snapshot();
+    stats.colorBytes = d->colorBytes();
+    stats.cellBytes = d->cellBytes();
+    stats.cacheBytes = d->cacheBytes();
+    return stats;
+}
+
+void DtwImage::resetStatistics()
+{
+    Q_D(DtwImage);
+    d->stats.reset();
+}
+
+DtwImage::Backend DtwImage::backend() const
+{
+    Q_D(const DtwImage);
+    return d->backend;
+}
+
+int DtwImage::seamsPerPass() const
+{
+    Q_D(const DtwImage);
+    return d->options.seamsPerPass;
+}
+
+void DtwImage::setSeamsPerPass(int count)
+{
+    Q_D(DtwImage);
+    d->options.seamsPerPass = qMax(1, count);
+}
+
+int DtwImage::pyramidLevels() const
+{
+    Q_D(const DtwImage);
+    return d->options.pyramidLevels;
+}
+
+void DtwImage::setPyramidLevels(int levels)
+{
+    Q_D(DtwImage);
+    d->options.pyramidLevels = qMax(1, levels);
+}
+
+int DtwImage::pyramidBand() const
+{
+    Q_D(const DtwImage);
+    return d->options.pyramidBand;
+}
+
+void DtwImage::setPyramidBand(int band)
+{
+    Q_D(DtwImage);
+    d->options.pyramidBand = qMax(1, band);
+}
+
 DtwImage DtwImage::clone() const
 {
     return DtwImage(*this);
 }
 
+//Works on a copy, whose statistics are added to the ones of this image
 QImage DtwImage::resize(const QSize& size) const
 {
+    Q_D(const DtwImage);
     DtwImage tp(*this);
+    tp.d_ptr->stats.reset();
     tp.d_ptr->resize(size);
-    return tp.d_ptr->makeImage();
+    const QImage image = tp.d_ptr->makeImage();
+    d->stats.merge(tp.d_ptr->stats.snapshot());
+    return image;
+}
+
+static float detailRatio(int detailPercent)
+{
+    return (detailPercent > 0 && detailPercent <= 100)
+           ? (100.0 / detailPercent) : DEF_CONTOUR_RATIO;
 }
 
 QImage DtwImage::makeColoringPage(int detailPercent) const
 {
     Q_D(const DtwImage);
-    float detailRatio = (detailPercent > 0 && detailPercent <= 100)
-                      ? (100.0 / detailPercent) : DEF_CONTOUR_RATIO;
-    return d->makeHighEnergyImage(detailRatio);
+    return d->makeHighEnergyImage(detailRatio(detailPercent));
 }
 
 QImage DtwImage::makeColoringPage(int detailRatio, const QSize& size) const
@@ -92,290 +216,230 @@ QImage DtwImage::makeColoringPage(int detailRatio, const QSize& size) const
     return makeColoringPage(detailRatio).scaled(size);
 }
 
-DtwImagePrivate::Cell::Cell()
-    : neighbours(), energy(BORDER_ENERGY)
-{}
+QList<QImage> DtwImage::makeColoringPages(const QList<int>& detailPercents) const
+{
+    Q_D(const DtwImage);
+    QList<float> ratios;
+    foreach (const int detailPercent, detailPercents)
+        ratios.append(detailRatio(detailPercent));
+    return d->makeHighEnergyImages(ratios);
+}
 
-energy_t DtwImagePrivate::dualGradientEnergy(int left, int right, int up, int down) const {
+QList<QPolygon> DtwImage::findContours(int detailPercent, int minLength) const
+{
+    Q_D(const DtwImage);
+    QList<QPolygon> outlines;
+    foreach (const DtwImagePrivate::Contour& contour, d->findAllCountours(detailRatio(detailPercent), minLength))
+        outlines.append(contour.outline);
+    return outlines;
+}
+
+DtwImagePrivate::Cells::Cells(int size, bool isLinked)
+    : energy(size, BORDER_ENERGY)
+{
+    if (!isLinked) return;
+    for (QVector<index_t>& links : neighbours)
+        links.fill(0, size);
+}
 
-    const QRgb pX = colors[left];
-    const QRgb sX = colors[right];
-    const QRgb pY = colors[up];
-    const QRgb sY = colors[down];
-
-    const int RpX  = qRed(pX);
-    const int GpX  = qGreen(pX);
-    const int BpX  = qBlue(pX);
-    const int RsX  = qRed(sX);
-    const int GsX  = qGreen(sX);
-    const int BsX  = qBlue(sX);
-    const int RpY  = qRed(pY);
-    const int GpY  = qGreen(pY);
-    const int BpY  = qBlue(pY);
-    const int RsY  = qRed(sY);
-    const int GsY  = qGreen(sY);
-    const int BsY  = qBlue(sY);
-
-    const int dRx  = RpX - RsX;
-    const int dGx  = GpX - GsX;
-    const int dBx  = BpX - BsX;
-    const int dRy  = RpY - RsY;
-    const int dGy  = GpY - GsY;
-    const int dBy  = BpY - BsY;
-
-    const energy_t Dx2  = dRx*dRx + dGx*dGx + dBx*dBx;
-    const energy_t Dy2  = dRy*dRy + dGy*dGy + dBy*dBy;
-
-    return std::sqrt(Dx2 + Dy2);
-/*
-    const energy_t xBase = right - left;
-    const energy_t yBase = down - up;
-
-    return std::sqrt(Dx2/xBase/xBase + Dy2/yBase/yBase);
-*/
+energy_t DtwImagePrivate::dualGradientEnergy(int left, int right, int up, int down) const {
+    return kernels::dualGradient(colors()[left], colors()[right], colors()[up], colors()[down]);
 }
 
 DtwImagePrivate::DtwImagePrivate(DtwImage *q, const QSize& size)
 : q_ptr(q), size(size), NM(size.height() * size.width()),
-  colors(NM), cells(NM),
+  backend(DtwImage::LINKED_GRID), pixels(size, DtwImage::DTW_FORMAT),
+  isTransposed(false), cells(NM, true),
   startingCell(INVALID_INDEX)
 {}
 
 DtwImagePrivate::DtwImagePrivate(DtwImage *q, const DtwImagePrivate* r)
 : q_ptr(q), size(r->size), NM(r->NM),
-  colors(r->colors), cells(r->cells),
-  startingCell(r->startingCell)
+  backend(r->backend), pixels(r->pixels),
+  isTransposed(r->isTransposed), cells(r->cells),
+  startingCell(r->startingCell), options(r->options), stats(r->stats)
 {}
 
 
-DtwImagePrivate::DtwImagePrivate(DtwImage *q, QImage img)
+DtwImagePrivate::DtwImagePrivate(DtwImage *q, const QImage& img, DtwImage::Backend backend)
     : q_ptr(q), size(img.size()), NM(size.height() * size.width()),
-      colors(NM), cells(NM),
+      backend(backend), isTransposed(false),
+      cells(NM, backend == DtwImage::LINKED_GRID),
       startingCell(0)
 {
-    BENCHMARK_START();
-    if (img.format() != q->DTW_FORMAT)
-        img = img.convertToFormat(q->DTW_FORMAT, Qt::AutoColor);
+    PROFILE_FUNCTION();
+    StatisticsTimer timer(stats, &DtwImage::Statistics::constructionTime);
     const int height = size.height();
     const int width  = size.width();
     if (height < 3 || width < 3)  throw std::invalid_argument("Incorrect image dimensions");
-    //Fillin colors
-    {
-        int k = 0;
-        for (int i = 0; i < height; i++) {
-            const QRgb* rawLine = reinterpret_cast<const QRgb*>(img.constScanLine(i));
-            for (int j = 0; j < width; j++)
-            {
-                colors[k++] = rawLine[j];
-            }
+    pixels = ingest(img);
+
+    //Rows are independent once the colours are in place
+    StatisticsTimer energyTimer(stats, &DtwImage::Statistics::energyTime);
+    const QRgb * const colorsData = colors();
+    energy_t * const energyData = cells.energy.data();
+    parallel::forBands(height, MIN_ROWS_PER_BAND, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const QRgb* line = colorsData + i*width;
+            const QRgb* up = (i > 0) ? line - width : line;
+            const QRgb* down = (i < height - 1) ? line + width : line;
+            if (!isDense()) linkLine(i);
+            kernels::dualGradientRow(up, line, down, width, energyData + i*width);
         }
-    }
-
-    //Establish connections and calculate energy
-    {
-        const int down = width;
-        const int right = 1;
-        cells[0].neighbours[LEFT] = INVALID_INDEX;
-        cells[0].neighbours[UP] = INVALID_INDEX;
-        cells[0].neighbours[RIGHT] = right;
-        cells[0].neighbours[DOWN] = down;
-#ifdef DIAGONAL_NEIGHBOURS
-        cells[0].neighbours[DOWN_LEFT] = INVALID_INDEX;
-        cells[0].neighbours[UP_LEFT] = INVALID_INDEX;
-        cells[0].neighbours[UP_RIGHT] = INVALID_INDEX;
-        cells[0].neighbours[DOWN_RIGHT] = down + 1;
-#endif
-        cells[0].energy = dualGradientEnergy(0, right, 0, down);
-    }
-    for (int j = 1; j < width - 1; j++)
-    {
-        const int down = j + width;
-        const int right = j + 1;
-        const int left = j - 1;
-        cells[j].neighbours[UP] = INVALID_INDEX;
-        cells[j].neighbours[RIGHT] = right;
-        cells[j].neighbours[DOWN] = down;
-        cells[j].neighbours[LEFT] = left;
-#ifdef DIAGONAL_NEIGHBOURS
-        cells[j].neighbours[UP_LEFT] = INVALID_INDEX;
-        cells[j].neighbours[UP_RIGHT] = INVALID_INDEX;
-        cells[j].neighbours[DOWN_RIGHT] = down + 1;
-        cells[j].neighbours[DOWN_LEFT] = down - 1;
-#endif
+    });
+    notePeakBytes();
+}
 
-        cells[j].energy = dualGradientEnergy(left, right, j, down);
-    }
-    {
-        int k = width - 1;
-        const int down = k + width;;
-        const int left = k - 1;
-        cells[k].neighbours[UP] = INVALID_INDEX;
-        cells[k].neighbours[RIGHT] = INVALID_INDEX;
-        cells[k].neighbours[DOWN] = down;
-        cells[k].neighbours[LEFT] = left;
-#ifdef DIAGONAL_NEIGHBOURS
-        cells[k].neighbours[UP_LEFT] = INVALID_INDEX;
-        cells[k].neighbours[UP_RIGHT] = INVALID_INDEX;
-        cells[k].neighbours[DOWN_RIGHT] = INVALID_INDEX;
-        cells[k].neighbours[DOWN_LEFT] = down - 1;
-#endif
-        cells[k].energy = dualGradientEnergy( left, k, k, down );
-    }
-    int k = width;
-    for (int i = 1; i < height - 1; i++) {
-        {
-            const int up = k - width;
-            const int down = k + width;
-            const int right = k + 1;
-            cells[k].neighbours[LEFT] = INVALID_INDEX;
-            cells[k].neighbours[UP] = up;
-            cells[k].neighbours[RIGHT] = right;
-            cells[k].neighbours[DOWN] = down;
-#ifdef DIAGONAL_NEIGHBOURS
-            cells[k].neighbours[DOWN_LEFT] = INVALID_INDEX;
-            cells[k].neighbours[UP_LEFT] = INVALID_INDEX;
-            cells[k].neighbours[DOWN_RIGHT] = down + 1;
-            cells[k].neighbours[UP_RIGHT] = up + 1;
-#endif
-            cells[k].energy = dualGradientEnergy( k, right, up, down );
-            k++;
-        }
-        for (int j = 1; j < width - 1; j++)
-        {
-            const int up = k - width;
-            const int down = k + width;
-            const int left = k - 1;
-            const int right = k + 1;
-            cells[k].neighbours[UP] = up;
-            cells[k].neighbours[RIGHT] = right;
-            cells[k].neighbours[DOWN] = down;
-            cells[k].neighbours[LEFT] = left;
-#ifdef DIAGONAL_NEIGHBOURS
-            cells[k].neighbours[UP_LEFT] = up - 1;
-            cells[k].neighbours[UP_RIGHT] = up + 1;
-            cells[k].neighbours[DOWN_RIGHT] = down + 1;
-            cells[k].neighbours[DOWN_LEFT] = down - 1;
-#endif
-            cells[k].energy = dualGradientEnergy( left, right, up, down );
-            k++;
-        }
-        {
-            const int up = k - width;
-            const int down = k + width;
-            const int left = k - 1;
-            cells[k].neighbours[UP] =  up;
-            cells[k].neighbours[RIGHT] = INVALID_INDEX;
-            cells[k].neighbours[DOWN] = down;
-            cells[k].neighbours[LEFT] = left;
-#ifdef DIAGONAL_NEIGHBOURS
-            cells[k].neighbours[UP_LEFT] =  up - 1;
-            cells[k].neighbours[UP_RIGHT] =  INVALID_INDEX;
-            cells[k].neighbours[DOWN_RIGHT] = INVALID_INDEX;
-            cells[k].neighbours[DOWN_LEFT] = down - 1;
-#endif
-            cells[k].energy = dualGradientEnergy( left, k, up, down );
-            k++;
+//Shares the source buffer when it is already laid out as DTW_FORMAT,
+//otherwise converts it strip by strip straight into a new buffer.
+QImage DtwImagePrivate::ingest(const QImage& img)
+{
+    const int width = img.width();
+    if (img.format() == DtwImage::DTW_FORMAT && img.bytesPerLine() == width * int(sizeof(QRgb)))
+        return img;
+
+    QImage target(img.size(), DtwImage::DTW_FORMAT);
+    QRgb * const targetData = reinterpret_cast<QRgb *>(target.bits());
+    parallel::forBands(img.height(), CONVERSION_STRIP, [&](int begin, int end) {
+        for (int y = begin; y < end; y += CONVERSION_STRIP) {
+            const int rows = qMin(CONVERSION_STRIP, end - y);
+            if (img.format() == QImage::Format_RGB32 || img.format() == DtwImage::DTW_FORMAT) {
+                //Same pixel layout, only the stride or the alpha byte may differ
+                const QRgb alpha = (img.format() == QImage::Format_RGB32) ? 0xff000000 : 0;
+                for (int i = y; i < y + rows; i++) {
+                    const QRgb * line = reinterpret_cast<const QRgb *>(img.constScanLine(i));
+                    QRgb * out = targetData + i*width;
+                    for (int j = 0; j < width; j++)
+                        out[j] = line[j] | alpha;
+                }
+                continue;
+            }
+            const QImage strip = img.copy(QRect(0, y, width, rows))
+                                    .convertToFormat(DtwImage::DTW_FORMAT, Qt::AutoColor);
+            for (int i = 0; i < rows; i++) {
+                const QRgb * line = reinterpret_cast<const QRgb *>(strip.constScanLine(i));
+                std::copy(line, line + width, targetData + (y + i)*width);
+            }
         }
-    }
-    {
-        const int up = k - width;
-        const int right = k + 1;
-        cells[k].neighbours[LEFT] = INVALID_INDEX;
-        cells[k].neighbours[UP] = up;
-        cells[k].neighbours[RIGHT] = right;
-        cells[k].neighbours[DOWN] = INVALID_INDEX;
-#ifdef DIAGONAL_NEIGHBOURS
-        cells[k].neighbours[DOWN_LEFT] = INVALID_INDEX;
-        cells[k].neighbours[UP_LEFT] = INVALID_INDEX;
-        cells[k].neighbours[UP_RIGHT] = up + 1;
-        cells[k].neighbours[DOWN_RIGHT] = INVALID_INDEX;
-#endif
-        cells[k].energy = dualGradientEnergy( k, right, up, k );
-        k++;
-    }
-    for (int j = 1; j < width - 1; j++)
-    {
-        const int up = k - width;
-        const int left = k - 1;
-        const int right = k + 1;
-        cells[k].neighbours[UP] = up;
-        cells[k].neighbours[RIGHT] = right;
-        cells[k].neighbours[DOWN] = INVALID_INDEX;
-        cells[k].neighbours[LEFT] = left;
+    });
+    return target;
+}
+
+void DtwImagePrivate::linkLine(int i)
+{
+    const int width = size.width();
+    const bool top = (i == 0);
+    const bool bottom = (i == size.height() - 1);
+    const index_t first = i * width;
+    const index_t last = first + width - 1;
+    std::array<index_t*, NEIGHBOUR_LAST> links;
+    for (int dir = 0; dir < NEIGHBOUR_LAST; dir++)
+        links[dir] = cells.neighbours[dir].data();
+
+    for (index_t k = first; k <= last; k++) {
+        links[UP][k] = top ? INVALID_INDEX : k - width;
+        links[RIGHT][k] = k + 1;
+        links[DOWN][k] = bottom ? INVALID_INDEX : k + width;
+        links[LEFT][k] = k - 1;
 #ifdef DIAGONAL_NEIGHBOURS
-        cells[k].neighbours[UP_LEFT] = up - 1;
-        cells[k].neighbours[UP_RIGHT] = up + 1;
-        cells[k].neighbours[DOWN_RIGHT] = INVALID_INDEX;
-        cells[k].neighbours[DOWN_LEFT] = INVALID_INDEX;
+        links[UP_LEFT][k] = top ? INVALID_INDEX : k - width - 1;
+        links[UP_RIGHT][k] = top ? INVALID_INDEX : k - width + 1;
+        links[DOWN_RIGHT][k] = bottom ? INVALID_INDEX : k + width + 1;
+        links[DOWN_LEFT][k] = bottom ? INVALID_INDEX : k + width - 1;
 #endif
-        cells[k].energy = dualGradientEnergy( left, right, up, k );
-        k++;
     }
-    {
-        const int up = k - width;
-        const int left = k - 1;
-        cells[k].neighbours[UP] =  up;
-        cells[k].neighbours[RIGHT] = INVALID_INDEX;
-        cells[k].neighbours[DOWN] = INVALID_INDEX;
-        cells[k].neighbours[LEFT] = left;
+    links[LEFT][first] = INVALID_INDEX;
+    links[RIGHT][last] = INVALID_INDEX;
 #ifdef DIAGONAL_NEIGHBOURS
-        cells[k].neighbours[UP_LEFT] =  up - 1;
-        cells[k].neighbours[UP_RIGHT] =  INVALID_INDEX;
-        cells[k].neighbours[DOWN_RIGHT] = INVALID_INDEX;
-        cells[k].neighbours[DOWN_LEFT] = INVALID_INDEX;
+    links[UP_LEFT][first] = INVALID_INDEX;
+    links[DOWN_LEFT][first] = INVALID_INDEX;
+    links[UP_RIGHT][last] = INVALID_INDEX;
+    links[DOWN_RIGHT][last] = INVALID_INDEX;
 #endif
-        cells[k].energy = dualGradientEnergy( left, k, up, k );
-    }
-    Q_ASSERT(++k == NM);
-    BENCHMARK_STOP();
 }
 
 QImage DtwImagePrivate::makeHighEnergyImage(float ratio) const
 {
-    BENCHMARK_START();
-    const energy_t threshold = getThresholdEnergy(ratio);
-    BENCHMARK_STOP();
-    BENCHMARK_START();
+    PROFILE_FUNCTION();
+    int thresholdRank;
+    const energy_t threshold = getThresholdEnergy(ratio, &thresholdRank);
+    StatisticsTimer timer(stats, &DtwImage::Statistics::rasterizationTime);
+    return rasterize(threshold, thresholdRank);
+}
+
+//Thresholds are found one after another, they share the rank cache and the
+//statistics. The pages are rasterized side by side.
+QList<QImage> DtwImagePrivate::makeHighEnergyImages(const QList<float>& ratios) const
+{
+    PROFILE_FUNCTION();
+    const int count = ratios.size();
+    QVector<energy_t> thresholds(count);
+    QVector<int> thresholdRanks(count);
+    for (int i = 0; i < count; i++)
+        thresholds[i] = getThresholdEnergy(ratios.at(i), &thresholdRanks[i]);
+
+    StatisticsTimer timer(stats, &DtwImage::Statistics::rasterizationTime);
+    QVector<QImage> images(count);
+    parallel::forBands(count, 1, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+            images[i] = rasterize(thresholds[i], thresholdRanks[i]);
+    });
+    return images.toList();
+}
+
+QImage DtwImagePrivate::rasterize(energy_t threshold, int thresholdRank) const
+{
     QImage energyImage = QImage(size, QImage::Format_Grayscale8);
-    const int width =  size.width() - 1;
-    const int height = size.height() - 1;
-    for (int j = 0; j < height; j++) {
-        uchar * line = energyImage.scanLine(j);
-        for (int i = 1; i < width - 1; i++) {
-            line[i] = (energy(i,j) > threshold) ? 0 : 255;
+    const int width = size.width();
+    uchar * const bits = energyImage.bits();
+    const int bytesPerLine = energyImage.bytesPerLine();
+    const quint16 * const ranks = cache.ranks.constData();
+    const energy_t * const energies = cells.energy.constData();
+    parallel::forBands(size.height(), MIN_ROWS_PER_BAND, [&](int begin, int end) {
+        for (int j = begin; j < end; j++) {
+            kernels::thresholdRow(ranks + j*width, energies + j*width, width,
+                                  thresholdRank, threshold, bits + j*bytesPerLine);
         }
-    }
-    BENCHMARK_STOP();
+    });
     return energyImage;
 }
 
 QImage DtwImagePrivate::makeImage() const
 {
-    BENCHMARK_START();
+    PROFILE_FUNCTION();
+    StatisticsTimer timer(stats, &DtwImage::Statistics::rasterizationTime);
     int k = startingCell;
 
     if (k == INVALID_INDEX) return QImage();
+    if (size == pixels.size() && !isTransposed) return pixels; //Nothing was carved out yet
+    if (isDense() && !isTransposed) return pixels.copy(QRect(QPoint(0, 0), size));
+    if (isDense()) {
+        QImage image(size, DtwImage::DTW_FORMAT);
+        transposeTiles(colors(), stride(), reinterpret_cast<QRgb *>(image.bits()),
+                       image.bytesPerLine() / int(sizeof(QRgb)), size.height(), size.width());
+        return image;
+    }
 
-    Q_ASSERT(cells[k].neighbours[UP] < 0
-             && cells[k].neighbours[LEFT] < 0);
+    Q_ASSERT(cells.neighbours[UP][k] < 0
+             && cells.neighbours[LEFT][k] < 0);
 
     const int height = size.height();
     const int width = size.width();
 
+    const QRgb * const colorsData = colors();
     QImage image(size, DtwImage::DTW_FORMAT);
     for (int i = 0; i < height; i++) {
         QRgb * line = reinterpret_cast<QRgb *>(image.scanLine(i));
-        const int nextLineStart = cells[k].neighbours[DOWN];
+        const int nextLineStart = cells.neighbours[DOWN][k];
         for (int j = 0; j < width; j++) {
             Q_ASSERT(k >= 0 && k < cells.size());
-            line[j] = colors[k];
-            k = cells[k].neighbours[RIGHT];
+            line[j] = colorsData[k];
+            k = cells.neighbours[RIGHT][k];
         }
         Q_ASSERT(k < 0);
         k = nextLineStart;
     }
     Q_ASSERT(k < 0);
-    BENCHMARK_STOP();
     return image;
 }
 
@@ -418,35 +482,72 @@ QImage DtwImage::dumpImage() const {
 
 #endif
 
-energy_t DtwImagePrivate::getThresholdEnergy(float ratio) const {
-    //create a sorted array
-    if (!cache.isUpToDate) {
-        cache.sortedEnergies.clear();
-        cache.sortedEnergies.reserve(NM);
-        foreach(const Cell& cell, cells)
-            cache.sortedEnergies.append(cell.energy);
-        qSort(cache.sortedEnergies);
-        cache.isUpToDate = true;
-    }
-    energy_t threshold = cache.sortedEnergies[NM - NM/ratio];
+int DtwImagePrivate::Cache::rank(energy_t e) const {
+    if (!(e > 0.0)) return 0;
+    return qMin(RANK_LEVELS - 1, int(e * rankScale));
+}
+
+void DtwImagePrivate::updateCache() const {
+    if (cache.isUpToDate) return;
+    const energy_t * energies = cells.energy.constData();
+    energy_t maxEnergy = 0.0;
+    for (int i = 0; i < NM; i++)
+        maxEnergy = qMax(maxEnergy, energies[i]);
+    cache.rankScale = (maxEnergy > 0.0) ? (RANK_LEVELS - 1) / maxEnergy : 0.0;
+
+    cache.ranks.resize(NM);
+    quint16 * ranks = cache.ranks.data();
+    QVector<int>& histogram = cache.histogram;
+    histogram.fill(0, RANK_LEVELS + 1);
+    for (int i = 0; i < NM; i++) {
+        const int r = cache.rank(energies[i]);
+        ranks[i] = quint16(r);
+        histogram[r + 1]++;
+    }
+    for (int r = 1; r <= RANK_LEVELS; r++)
+        histogram[r] += histogram[r - 1];
+    cache.isUpToDate = true;
+}
+
+energy_t DtwImagePrivate::getThresholdEnergy(float ratio, int * rank) const {
+    PROFILE_FUNCTION();
+    StatisticsTimer timer(stats, &DtwImage::Statistics::thresholdTime);
+    updateCache();
+    const int k = NM - NM/ratio; //Position of the threshold in the sorted energies
+    //Only the cells sharing the k-th energy's rank need to be ordered
+    const QVector<int>& histogram = cache.histogram;
+    const int r = int(std::upper_bound(histogram.constBegin(), histogram.constEnd(), k)
+                      - histogram.constBegin()) - 1;
+    const quint16 * ranks = cache.ranks.constData();
+    const energy_t * energies = cells.energy.constData();
+    QVector<energy_t> candidates;
+    candidates.reserve(histogram[r + 1] - histogram[r]);
+    for (int i = 0; i < NM; i++) {
+        if (ranks[i] == r)
+            candidates.append(energies[i]);
+    }
+    const int nth = k - histogram[r];
+    std::nth_element(candidates.begin(), candidates.begin() + nth, candidates.end());
+    energy_t threshold = candidates[nth];
 #ifdef QT_DEBUG
     qDebug() << "Threshold energy:" << threshold;
 #endif
+    if (rank) *rank = r;
     return threshold;
 }
 
 energy_t DtwImagePrivate::energy(int x, int y) const {
     const int k = y*size.width() + x;
     Q_ASSERT(k>=0 && k < NM);
-    return cells[k].energy;
+    return cells.energy[k];
 }
 
 void DtwImagePrivate::updateEnergy(index_t idx) {
     Q_ASSERT(idx >= 0 && idx < NM);
-    index_t left =  cells[idx].neighbours[LEFT];
-    index_t right = cells[idx].neighbours[RIGHT];
-    index_t up = cells[idx].neighbours[UP];
-    index_t down = cells[idx].neighbours[DOWN];
+    index_t left =  cells.neighbours[LEFT][idx];
+    index_t right = cells.neighbours[RIGHT][idx];
+    index_t up = cells.neighbours[UP][idx];
+    index_t down = cells.neighbours[DOWN][idx];
 
     if (left == INVALID_INDEX) {
         left = idx;
@@ -460,97 +561,509 @@ void DtwImagePrivate::updateEnergy(index_t idx) {
     if (down == INVALID_INDEX) {
         down = idx;
     }
-    cells[idx].energy = dualGradientEnergy(left,right,up,down);
+    cells.energy[idx] = dualGradientEnergy(left,right,up,down);
+}
+
+void DtwImagePrivate::updateDenseEnergy(int x, int y) {
+    const QSize layout = layoutSize();
+    Q_ASSERT(x >= 0 && x < layout.width() && y >= 0 && y < layout.height());
+    const int w = stride();
+    const QRgb * const c = colors() + y*w + x;
+    cells.energy[y*w + x] = kernels::dualGradient(x > 0 ? c[-1] : c[0],
+                                                  x < layout.width() - 1 ? c[1] : c[0],
+                                                  y > 0 ? c[-w] : c[0],
+                                                  y < layout.height() - 1 ? c[w] : c[0]);
+}
+
+//The dual gradient is symmetric in x and y, so energies transpose as they are
+void DtwImagePrivate::transposeDense(bool transposed) {
+    if (isTransposed == transposed) return;
+    PROFILE_FUNCTION();
+    const QSize layout = layoutSize();
+    QImage target(layout.transposed(), DtwImage::DTW_FORMAT);
+    transposeTiles(colors(), stride(), reinterpret_cast<QRgb *>(target.bits()),
+                   layout.height(), layout.width(), layout.height());
+    QVector<energy_t> energy(NM);
+    transposeTiles(cells.energy.constData(), stride(), energy.data(),
+                   layout.height(), layout.width(), layout.height());
+    pixels = target;
+    cells.energy.swap(energy);
+    isTransposed = transposed;
+    seamMap.invalidate();
+    pyramid.invalidate();
+    cache.invalidate();
 }
 
 /////////////////////////////Seam operations///////////////////////////////////
 
-index_t DtwImagePrivate::SeamLayer::getMinPathEdge() const {
-    const int size = this->size();
-    index_t minEdge = INVALID_INDEX;
-    energy_t minDist = std::numeric_limits<energy_t>::infinity();
-    for (int i = 0; i < size; i++) {
-        const energy_t d = dist(i);
-        if (d < minDist) {
-            minDist = d;
-            minEdge = i;
+void DtwImagePrivate::SeamMap::reserve(int cellCount, int layerSize, int length) {
+    //Grow only, so repeated searches do not touch the allocator
+    if (distTo.size() < cellCount) {
+        distTo.resize(cellCount);
+        edgeTo.resize(cellCount);
+        marked.fill(0, cellCount);
+    }
+    if (fromCells.size() < layerSize) {
+        fromCells.resize(layerSize);
+        toCells.resize(layerSize);
+        fromDist.resize(layerSize);
+        toDist.resize(layerSize);
+        rowEnergy.resize(layerSize);
+        rowEdge.resize(layerSize);
+    }
+    if (path.size() < length)
+        path.resize(length);
+}
+
+void DtwImagePrivate::buildSeamMap(const Neighbour along, const Neighbour dir,
+                                   int layerSize, int length) const {
+    Q_ASSERT(layerSize > 1 && length > 0);
+    PROFILE_FUNCTION();
+    seamMap.reserve(NM, layerSize, length);
+    const index_t * const next = cells.neighbours[dir].constData();
+    const index_t * const forward = cells.neighbours[along].constData();
+    const energy_t * const energy = cells.energy.constData();
+    index_t * fromCells = seamMap.fromCells.data();
+    index_t * toCells = seamMap.toCells.data();
+    energy_t * fromDist = seamMap.fromDist.data();
+    energy_t * toDist = seamMap.toDist.data();
+    energy_t * const distTo = seamMap.distTo.data();
+    qint8 * const edgeTo = seamMap.edgeTo.data();
+
+    {//The first layer starts from the corner
+        index_t idx = startingCell;
+        for (int j = 0; j < layerSize; j++) {
+            Q_ASSERT(idx != INVALID_INDEX);
+            fromCells[j] = idx;
+            distTo[idx] = fromDist[j] = energy[idx];
+            edgeTo[idx] = 0;
+            idx = forward[idx];
         }
+        Q_ASSERT(idx == INVALID_INDEX);
     }
-    return minEdge;
+
+    //Gather each layer into contiguous rows for the relaxation kernel
+    energy_t * const rowEnergy = seamMap.rowEnergy.data();
+    qint8 * const rowEdge = seamMap.rowEdge.data();
+    for (int n = 1; n < length; n++) {
+        for (int j = 0; j < layerSize; j++) {
+            const index_t idx = next[fromCells[j]];
+            toCells[j] = idx;
+            rowEnergy[j] = energy[idx];
+        }
+        kernels::seamRow(fromDist, rowEnergy, layerSize, toDist, rowEdge);
+        for (int j = 0; j < layerSize; j++) {
+            distTo[toCells[j]] = toDist[j];
+            edgeTo[toCells[j]] = rowEdge[j];
+        }
+        std::swap(fromCells, toCells);
+        std::swap(fromDist, toDist);
+    }
+    seamMap.dir = dir;
+    seamMap.isUpToDate = true;
 }
 
-Seam DtwImagePrivate::findSeamHelper(SeamLayer&& firstLayer,
-                                     const Neighbour dir, int length) const {
-    BENCHMARK_START();
-    QList<SeamLayer*> layers;
-    const int layerCapacity = firstLayer.size();
-    Q_ASSERT(layerCapacity > 1);
+//Only cells next to the removed seam got new energies or new parents. Layer by
+//layer they are recomputed together with the children of every cell whose
+//cumulative energy actually moved, the rest of the map is still valid.
+void DtwImagePrivate::repairSeamMap(const Neighbour along, const Neighbour dir) {
+    PROFILE_FUNCTION();
+    const index_t * const next = cells.neighbours[dir].constData();
+    const index_t * const back = cells.neighbours[opposite(dir)].constData();
+    const index_t * const forward = cells.neighbours[along].constData();
+    const index_t * const backward = cells.neighbours[opposite(along)].constData();
+    const energy_t * const energy = cells.energy.constData();
+    energy_t * const distTo = seamMap.distTo.data();
+    qint8 * const edgeTo = seamMap.edgeTo.data();
+    quint8 * const marked = seamMap.marked.data();
+    const index_t * const sewn = seamMap.sewn.constData();
+    const int length = seamMap.sewn.size() / 2;
+    QVector<index_t>& dirty = seamMap.dirty;
+    QVector<index_t>& nextDirty = seamMap.nextDirty;
+
+    auto mark = [marked](QVector<index_t>& layer, index_t idx) {
+        if (idx != INVALID_INDEX && !marked[idx]) {
+            marked[idx] = 1;
+            layer.append(idx);
+        }
+    };
+
+    dirty.clear();
+    for (int n = 0; n < length; n++) {
+        nextDirty.clear();
+        for (int k = 2*n; k < 2*n + 2; k++) {
+            mark(dirty, sewn[k]);
+            //The children of a sewn cell have a new parent next to it
+            if (sewn[k] != INVALID_INDEX) mark(nextDirty, next[sewn[k]]);
+        }
+        for (const index_t idx : dirty) {
+            marked[idx] = 0;
+            const energy_t e = energy[idx];
+            energy_t dist = e;
+            qint8 edge = 0;
+            if (n > 0) {
+                const index_t up = back[idx];
+                dist = e + distTo[up];
+                const index_t left = backward[up];
+                if (left != INVALID_INDEX && e + distTo[left] < dist) {
+                    dist = e + distTo[left];
+                    edge = -1;
+                }
+                const index_t right = forward[up];
+                if (right != INVALID_INDEX && e + distTo[right] < dist) {
+                    dist = e + distTo[right];
+                    edge = 1;
+                }
+            }
+            edgeTo[idx] = edge;
+            if (dist != distTo[idx] && n < length - 1) {
+                const index_t child = next[idx];
+                mark(nextDirty, child);
+                mark(nextDirty, backward[child]);
+                mark(nextDirty, forward[child]);
+            }
+            distTo[idx] = dist;
+        }
+        std::swap(dirty, nextDirty);
+    }
+    Q_ASSERT(dirty.isEmpty());
+}
+
+//Same map over dense rows, indexed by y*stride() + x. Layers are rows
+//already, so the kernel runs straight on the map.
+void DtwImagePrivate::buildDenseSeamMap(int layerSize, int length) const {
+    Q_ASSERT(layerSize > 1 && length > 0);
+    PROFILE_FUNCTION();
+    seamMap.reserve(NM, layerSize, length);
+    const int w = stride();
+    const energy_t * const energy = cells.energy.constData();
+    energy_t * const distTo = seamMap.distTo.data();
+    qint8 * const edgeTo = seamMap.edgeTo.data();
+    std::copy(energy, energy + layerSize, distTo);
+    std::fill(edgeTo, edgeTo + layerSize, 0);
+    for (int n = 1; n < length; n++)
+        kernels::seamRow(distTo + (n - 1)*w, energy + n*w, layerSize, distTo + n*w, edgeTo + n*w);
+    seamMap.dir = DOWN;
+    seamMap.isUpToDate = true;
+}
 
-    layers.reserve(length);
+//The map rows were shifted together with the pixels, so only a span around
+//the removed column of every row and the spans below the values that moved
+//need to be relaxed again.
+void DtwImagePrivate::repairDenseSeamMap() {
+    PROFILE_FUNCTION();
+    const int w = stride();
+    const int width = layoutSize().width();
+    const int height = layoutSize().height();
+    const int * const removed = seamMap.sewn.constData();
+    const energy_t * const energy = cells.energy.constData();
+    energy_t * const distTo = seamMap.distTo.data();
+    qint8 * const edgeTo = seamMap.edgeTo.data();
+    energy_t * const rowDist = seamMap.toDist.data();
+    qint8 * const rowEdge = seamMap.rowEdge.data();
+
+    int begin = 0, end = 0;
+    for (int y = 0; y < height; y++) {
+        const int above = (y > 0) ? removed[y - 1] : removed[y];
+        const int seedBegin = qMax(0, qMin(removed[y], above) - 2);
+        const int seedEnd = qMin(width, qMax(removed[y], above) + 2);
+        if (begin < end) {
+            begin = qMin(begin, seedBegin);
+            end = qMax(end, seedEnd);
+        } else {
+            begin = seedBegin;
+            end = seedEnd;
+        }
 
-    SeamLayer* currentLayer = new SeamLayer(firstLayer);
+        energy_t * const dist = distTo + y*w;
+        qint8 * const edge = edgeTo + y*w;
+        if (y == 0) {
+            std::copy(energy + begin, energy + end, rowDist + begin);
+            std::fill(rowEdge + begin, rowEdge + end, 0);
+        } else {
+            kernels::seamRowSpan(dist - w, energy + y*w, width, begin, end, rowDist, rowEdge);
+        }
+        int changedBegin = end, changedEnd = begin;
+        for (int j = begin; j < end; j++) {
+            if (rowDist[j] != dist[j]) {
+                changedBegin = qMin(changedBegin, j);
+                changedEnd = j + 1;
+            }
+            dist[j] = rowDist[j];
+            edge[j] = rowEdge[j];
+        }
+        //Children of a moved cell are at most one column off
+        if (changedBegin < changedEnd) {
+            begin = qMax(0, changedBegin - 1);
+            end = qMin(width, changedEnd + 1);
+        } else {
+            begin = end = 0;
+        }
+    }
+}
 
-    //relax all interlayer edges in loop
-    while(--length) {
-        int j = 0;
-        SeamLayer* nextLayer = new SeamLayer(layerCapacity);
+//Seams of one dense pass are shifted as if the earlier ones were removed already
+void DtwImagePrivate::alignDenseSeams(QList<Seam>& seams) const {
+    QList<Seam> aligned = seams;
+    for (int i = 1; i < seams.size(); i++) {
+        Seam& seam = aligned[i];
+        for (int j = 0; j < i; j++)
+            for (int n = 0; n < seam.size(); n++)
+                if (seams.at(j).at(n) < seams.at(i).at(n)) seam[n]--;
+    }
+    seams = aligned;
+}
 
-        {//Special handle for the first cell in row
-            const index_t up = currentLayer->index(0);
-            const index_t idx = cells[up].neighbours[dir];
-            nextLayer->add(idx, 0, cells[idx].energy + currentLayer->dist(0));
-            nextLayer->relax(1, cells[idx].energy + currentLayer->dist(1));
+//Cells of the seam ending at "end", first layer first, into seamMap.path
+Seam DtwImagePrivate::traceSeam(index_t end, const Neighbour along, const Neighbour dir, int length) const {
+    const index_t * const back = cells.neighbours[opposite(dir)].constData();
+    const index_t * const forward = cells.neighbours[along].constData();
+    const index_t * const backward = cells.neighbours[opposite(along)].constData();
+    const qint8 * const edgeTo = seamMap.edgeTo.constData();
+    index_t * const path = seamMap.path.data();
+    index_t idx = end;
+    if (isDense()) {
+        for (int n = length - 1; n > 0; n--) {
+            path[n] = idx;
+            idx += edgeTo[idx] - stride();
         }
-        for (j = 1; j < (layerCapacity - 1); j++)
-        {//Adding a new edge and relaxing diagonales
-            const index_t up = currentLayer->index(j);
-            const index_t idx = cells[up].neighbours[dir];
-            nextLayer->add(idx, j, cells[idx].energy + currentLayer->dist(j));
-            nextLayer->relax(j - 1, cells[idx].energy + currentLayer->dist(j - 1));
-            nextLayer->relax(j + 1, cells[idx].energy + currentLayer->dist(j + 1));
+    } else {
+        for (int n = length - 1; n > 0; n--) {
+            path[n] = idx;
+            const index_t up = back[idx];
+            idx = edgeTo[idx] == 0 ? up : (edgeTo[idx] < 0 ? backward[up] : forward[up]);
         }
-        {//Special handle for the last cell in row - relaxing 2 edges
-            const index_t up = currentLayer->index(j);
-            const index_t idx = cells[up].neighbours[dir];
-            nextLayer->add(idx, j, cells[idx].energy + currentLayer->dist(j));
-            nextLayer->relax(j - 1, cells[idx].energy + currentLayer->dist(j - 1));
+    }
+    path[0] = idx;
+    Seam seam;
+    seam.reserve(length);
+    for (int n = 0; n < length; n++)
+        seam.append(path[n]);
+    return seam;
+}
+
+//Cheapest path through the layers of "energy" that keeps within [lo, hi) of
+//every layer. Cells outside the bands cost infinity, ties go to the first
+//candidate as in the exact search.
+static void findBandedPath(const energy_t * energy, int stride, int width, int height,
+                           const int * lo, const int * hi, QVector<energy_t>& fromDist,
+                           QVector<energy_t>& toDist, QVector<qint8>& rowEdge,
+                           QVector<qint8>& edges, int * path)
+{
+    const energy_t infinity = std::numeric_limits<energy_t>::infinity();
+    fromDist.fill(infinity, width);
+    toDist.fill(infinity, width);
+    rowEdge.resize(width);
+    int total = 0;
+    for (int y = 0; y < height; y++)
+        total += hi[y] - lo[y];
+    edges.resize(total);
+
+    energy_t * from = fromDist.data();
+    energy_t * to = toDist.data();
+    int offset = 0;
+    for (int y = 0; y < height; y++) {
+        const energy_t * const row = energy + y*stride;
+        if (y == 0) {
+            std::copy(row + lo[0], row + hi[0], to + lo[0]);
+            std::fill(rowEdge.begin() + lo[0], rowEdge.begin() + hi[0], 0);
+        } else {
+            kernels::seamRowSpan(from, row, width, lo[y], hi[y], to, rowEdge.data());
+            std::fill(from + lo[y - 1], from + hi[y - 1], infinity);
+        }
+        std::copy(rowEdge.constBegin() + lo[y], rowEdge.constBegin() + hi[y], edges.begin() + offset);
+        offset += hi[y] - lo[y];
+        std::swap(from, to);
+    }
+
+    int best = lo[height - 1];
+    for (int x = best + 1; x < hi[height - 1]; x++)
+        if (from[x] < from[best]) best = x;
+    path[height - 1] = best;
+    for (int y = height - 1; y > 0; y--) {
+        offset -= hi[y] - lo[y];
+        path[y - 1] = path[y] + edges[offset + path[y] - lo[y]];
+    }
+}
+
+//A seam found on an energy pyramid: an exact search on the coarsest level,
+//then searches restricted to a band around the seam projected onto every
+//finer level.
+Seam DtwImagePrivate::findPyramidSeam(const Neighbour dir, int layerSize, int length) const {
+    PROFILE_FUNCTION();
+    SeamPyramid& p = pyramid;
+
+    //Level 0 is the dense buffer itself, laid out layer by layer
+    Q_ASSERT(isDense());
+    const energy_t * const base = cells.energy.constData();
+    const int baseStride = stride();
+
+    //Coarser levels average 2x2 blocks, as long as layers keep two cells.
+    //They are only rebuilt every "band" seams: the seams removed in between
+    //shift level 0 by less than the band it is refined over.
+    const bool isStale = p.age < 0 || p.age >= options.pyramidBand || p.dir != dir
+                      || p.sizes.isEmpty() || p.sizes[0].height() != length
+                      || p.requestedLevels != options.pyramidLevels;
+    if (isStale) {
+        p.sizes.clear();
+        p.sizes.append(QSize(layerSize, length));
+        while (p.sizes.size() < options.pyramidLevels && (p.sizes.last().width() + 1) / 2 > 1)
+            p.sizes.append(QSize((p.sizes.last().width() + 1) / 2, (p.sizes.last().height() + 1) / 2));
+        p.dir = dir;
+        p.age = 0;
+        p.requestedLevels = options.pyramidLevels;
+    }
+    p.sizes[0] = QSize(layerSize, length);
+    p.age++;
+    const int levels = p.sizes.size();
+    p.levels.resize(levels);
+    for (int l = 1; isStale && l < levels; l++) {
+        const QSize fine = p.sizes[l - 1];
+        const QSize coarse = p.sizes[l];
+        const energy_t * const in = (l == 1) ? base : p.levels[l - 1].constData();
+        const int inStride = (l == 1) ? baseStride : fine.width();
+        QVector<energy_t>& out = p.levels[l];
+        out.resize(coarse.width() * coarse.height());
+        for (int y = 0; y < coarse.height(); y++) {
+            const energy_t * const top = in + 2*y*inStride;
+            const energy_t * const bottom = (2*y + 1 < fine.height()) ? top + inStride : top;
+            for (int x = 0; x < coarse.width(); x++) {
+                const int right = (2*x + 1 < fine.width()) ? 2*x + 1 : 2*x;
+                out[y*coarse.width() + x] = (top[2*x] + top[right] + bottom[2*x] + bottom[right]) / 4;
+            }
+        }
+    }
+
+    for (int l = levels - 1; l >= 0; l--) {
+        const QSize level = p.sizes[l];
+        p.lo.resize(level.height());
+        p.hi.resize(level.height());
+        if (l == levels - 1) {
+            std::fill(p.lo.begin(), p.lo.end(), 0);
+            std::fill(p.hi.begin(), p.hi.end(), level.width());
+        } else {
+            //Centres follow the coarse seam, interpolated so they move by one at most
+            const int coarseLength = p.sizes[l + 1].height();
+            for (int y = 0; y < level.height(); y++) {
+                const int k = y / 2;
+                const int centre = qMin(level.width() - 1, (y % 2 == 0 || k + 1 == coarseLength)
+                                                           ? 2*p.coarsePath[k]
+                                                           : p.coarsePath[k] + p.coarsePath[k + 1]);
+                p.lo[y] = qMax(0, centre - options.pyramidBand);
+                p.hi[y] = qMin(level.width(), centre + options.pyramidBand + 2);
+            }
         }
-        Q_ASSERT(nextLayer->size() == layerCapacity);
-        layers.append(currentLayer);
-        currentLayer = nextLayer;
+        p.path.resize(level.height());
+        findBandedPath(l == 0 ? base : p.levels[l].constData(), l == 0 ? baseStride : level.width(),
+                       level.width(), level.height(), p.lo.constData(), p.hi.constData(),
+                       p.fromDist, p.toDist, p.rowEdge, p.edges, p.path.data());
+        p.coarsePath.swap(p.path);
     }
 
-    //Traverse minimal path
-    index_t minPathEdge = currentLayer->getMinPathEdge();
     Seam seam;
     seam.reserve(length);
-    seam.prepend(currentLayer->index(minPathEdge));
-    do {
-        SeamLayer * lastLayer = layers.takeLast();
-        minPathEdge = lastLayer->edge(minPathEdge);
-        seam.prepend(lastLayer->index(minPathEdge));
-        delete lastLayer;
-    } while (!layers.isEmpty());
-    BENCHMARK_STOP();
+    for (int n = 0; n < length; n++)
+        seam.append(n*stride() + p.coarsePath[n]);
     return seam;
 }
 
-Seam DtwImagePrivate::findVerticalSeam() const {
-    SeamLayer firstLayer(size.width());
-    index_t g = 0;
-    for (index_t i = startingCell; i != INVALID_INDEX; i = cells[i].neighbours[RIGHT])
-        firstLayer.add(i, g++, cells[i].energy);
-    Q_ASSERT(firstLayer.size() == size.width());
-    return findSeamHelper(std::move(firstLayer), DOWN, size.height());
+//Up to "count" disjoint seams out of a single map, cheapest first.
+//The pyramid search gives one seam at a time, so it is used for single ones.
+//The linked grid keeps the exact search: gathering its cells into layers
+//for the pyramid costs more than the search it would save.
+QList<Seam> DtwImagePrivate::findSeamHelper(const Neighbour along, const Neighbour dir,
+                                            int layerSize, int length, int count) const {
+    if (count == 1 && options.pyramidLevels > 1 && isDense()) {
+        QList<Seam> seams;
+        seams.append(findPyramidSeam(dir, layerSize, length));
+        return seams;
+    }
+    PROFILE_FUNCTION();
+    if (!seamMap.isUpToDate || seamMap.dir != dir) {
+        if (isDense()) buildDenseSeamMap(layerSize, length);
+        else buildSeamMap(along, dir, layerSize, length);
+    }
+    const energy_t * const distTo = seamMap.distTo.constData();
+
+    //The last layer, in order
+    QVector<index_t>& last = seamMap.fromCells;
+    if (isDense()) {
+        for (int j = 0; j < layerSize; j++)
+            last[j] = (length - 1)*stride() + j;
+    } else {
+        const index_t * const next = cells.neighbours[dir].constData();
+        const index_t * const forward = cells.neighbours[along].constData();
+        index_t idx = startingCell;
+        for (int n = 1; n < length; n++)
+            idx = next[idx];
+        for (int j = 0; j < layerSize; j++) {
+            Q_ASSERT(idx != INVALID_INDEX);
+            last[j] = idx;
+            idx = forward[idx];
+        }
+    }
+
+    QList<Seam> seams;
+    if (count == 1) {
+        int best = 0;
+        for (int j = 1; j < layerSize; j++)
+            if (distTo[last[j]] < distTo[last[best]]) best = j;
+        seams.append(traceSeam(last[best], along, dir, length));
+        return seams;
+    }
+
+    std::stable_sort(last.begin(), last.begin() + layerSize,
+                     [distTo](index_t a, index_t b) { return distTo[a] < distTo[b]; });
+    quint8 * const taken = seamMap.marked.data();
+    for (int j = 0; j < layerSize && seams.size() < count; j++) {
+        const Seam seam = traceSeam(last[j], along, dir, length);
+        //A seam touching a cell of a cheaper one is dropped
+        bool isDisjoint = true;
+        for (const index_t idx : seam)
+            if (taken[idx]) {
+                isDisjoint = false;
+                break;
+            }
+        if (!isDisjoint) continue;
+        for (const index_t idx : seam)
+            taken[idx] = 1;
+        seams.append(seam);
+    }
+    for (const Seam& seam : seams)
+        for (const index_t idx : seam)
+            taken[idx] = 0;
+    return seams;
+}
+
+Seam DtwImagePrivate::findVerticalSeam() {
+    return findVerticalSeams(1).first();
+}
+
+Seam DtwImagePrivate::findHorizontalSeam() {
+    return findHorizontalSeams(1).first();
 }
 
-Seam DtwImagePrivate::findHorizontalSeam() const {
-    SeamLayer firstLayer(size.height());
-    index_t g = 0;
-    for (index_t i = startingCell; i != INVALID_INDEX; i = cells[i].neighbours[DOWN])
-        firstLayer.add(i, g++, cells[i].energy);
-    Q_ASSERT(firstLayer.size() == size.height());
-    return findSeamHelper(std::move(firstLayer), RIGHT, size.width());
+QList<Seam> DtwImagePrivate::findVerticalSeams(int count) {
+    StatisticsTimer timer(stats, &DtwImage::Statistics::seamSearchTime);
+    if (isDense()) transposeDense(false);
+    const QList<Seam> seams = findSeamHelper(RIGHT, DOWN, size.width(), size.height(), count);
+    stats.add(&DtwImage::Statistics::seamSearches, 1);
+    stats.add(&DtwImage::Statistics::seamsFound, seams.size());
+    notePeakBytes();
+    return seams;
+}
+
+//Dense horizontal seams are vertical seams of the transposed buffers
+QList<Seam> DtwImagePrivate::findHorizontalSeams(int count) {
+    StatisticsTimer timer(stats, &DtwImage::Statistics::seamSearchTime);
+    if (isDense()) transposeDense(true);
+    const QList<Seam> seams = isDense()
+                            ? findSeamHelper(RIGHT, DOWN, size.height(), size.width(), count)
+                            : findSeamHelper(DOWN, RIGHT, size.height(), size.width(), count);
+    stats.add(&DtwImage::Statistics::seamSearches, 1);
+    stats.add(&DtwImage::Statistics::seamsFound, seams.size());
+    notePeakBytes();
+    return seams;
 }
 
 #ifdef QT_DEBUG
@@ -562,23 +1075,27 @@ QImage DtwImage::dumpSeams() const {
 
 void DtwImagePrivate::drawSeams() {
     cache.invalidate();
+    //Dense buffers may be transposed for the second seam, so paint in between
     Seam vSeam = findVerticalSeam();
-    Seam hSeam = findHorizontalSeam();
     foreach (index_t idx, vSeam) {
-        colors[idx] = Qt::red;
+        mutableColors()[idx] = Qt::red;
     }
+    Seam hSeam = findHorizontalSeam();
     foreach (index_t idx, hSeam) {
-        colors[idx] = Qt::red;
+        mutableColors()[idx] = Qt::red;
     }
 
 }
 
 void DtwImagePrivate::drawTopContour() {
+    const QList<Contour> contours = findAllCountours(DEF_CONTOUR_RATIO);
     cache.invalidate();
-    QPair<Seam, energy_t> contour = findContour(startingCell);
-    qInfo() << __PRETTY_FUNCTION__ << " : The top contour has energy " << contour.second;
-    foreach (index_t idx, contour.first) {
-        colors[idx] = Qt::green;
+    if (contours.isEmpty()) return;
+    qInfo() << __PRETTY_FUNCTION__ << " : The top contour has energy " << contours.first().energy;
+    const QVector<index_t> ids = layoutCells();
+    QRgb * const colorsData = mutableColors();
+    foreach (const QPoint& point, contours.first().outline) {
+        colorsData[ids[point.y()*size.width() + point.x()]] = Qt::green;
     }
 }
 
@@ -592,87 +1109,324 @@ QImage DtwImage::dumpTopContour() const {
 #endif
 
 void DtwImagePrivate::removeHorizontalSeam(const Seam& seam) {
+    StatisticsTimer timer(stats, &DtwImage::Statistics::seamRemovalTime);
+    stats.add(&DtwImage::Statistics::seamsRemoved, 1);
+    if (isDense()) {
+        transposeDense(true);
+        removeDenseSeam(seam);
+        return;
+    }
     cache.invalidate();
 #ifdef DIAGONAL_NEIGHBOURS
 #error "removeSeam() unable to handle diagonal neighbours"
 #endif
-    BENCHMARK_START();
+    PROFILE_FUNCTION();
     //Update starting cell
     index_t idx = seam.front();
-    if(idx == startingCell) startingCell = cells[idx].neighbours[DOWN];
+    if(idx == startingCell) startingCell = cells.neighbours[DOWN][idx];
+    seamMap.sewn.clear();
 
     //Sew cells
     for(int i = 0;;) {
-        const index_t up  = cells[idx].neighbours[UP];
-        const index_t down = cells[idx].neighbours[DOWN];
-        const index_t right = cells[idx].neighbours[RIGHT];
-        if(up != INVALID_INDEX) cells[up].neighbours[DOWN] = down;
-        if(down != INVALID_INDEX) cells[down].neighbours[UP] = up;
+        const index_t up  = cells.neighbours[UP][idx];
+        const index_t down = cells.neighbours[DOWN][idx];
+        const index_t right = cells.neighbours[RIGHT][idx];
+        seamMap.sewn.append(up);
+        seamMap.sewn.append(down);
+        if(up != INVALID_INDEX) cells.neighbours[DOWN][up] = down;
+        if(down != INVALID_INDEX) cells.neighbours[UP][down] = up;
         if(right == INVALID_INDEX) break;
         idx = seam[++i];
         if(idx != right) {
-            const index_t right_up = cells[right].neighbours[UP];
+            const index_t right_up = cells.neighbours[UP][right];
             if (idx == right_up) {
-                cells[right].neighbours[LEFT] = up;
-                cells[up].neighbours[RIGHT] = right;
+                cells.neighbours[LEFT][right] = up;
+                cells.neighbours[RIGHT][up] = right;
             } else {
-                Q_ASSERT (idx == cells[right].neighbours[DOWN]);
-                cells[right].neighbours[LEFT] = down;
-                cells[down].neighbours[RIGHT] = right;
+                Q_ASSERT (idx == cells.neighbours[DOWN][right]);
+                cells.neighbours[LEFT][right] = down;
+                cells.neighbours[RIGHT][down] = right;
             }
         }
     }
     size.rheight()--;
-    BENCHMARK_STOP();
+
+    //Only the cells the seam was sewn between got new neighbours
+    for (const index_t idx : seamMap.sewn)
+        if (idx != INVALID_INDEX) updateEnergy(idx);
+    if (seamMap.isUpToDate && seamMap.dir == RIGHT)
+        repairSeamMap(DOWN, RIGHT);
+    else
+        seamMap.invalidate();
 }
 
 void DtwImagePrivate::removeVerticalSeam(const Seam& seam) {
+    StatisticsTimer timer(stats, &DtwImage::Statistics::seamRemovalTime);
+    stats.add(&DtwImage::Statistics::seamsRemoved, 1);
+    if (isDense()) {
+        transposeDense(false);
+        removeDenseSeam(seam);
+        return;
+    }
     cache.invalidate();
 #ifdef DIAGONAL_NEIGHBOURS
 #error "removeSeam() unable to handle diagonal neighbours"
 #endif
-    BENCHMARK_START();
+    PROFILE_FUNCTION();
     //Update starting cell
     index_t idx = seam.front();
-    if(idx == startingCell) startingCell = cells[idx].neighbours[RIGHT];
+    if(idx == startingCell) startingCell = cells.neighbours[RIGHT][idx];
+    seamMap.sewn.clear();
 
     //Sew cells and update energy
     for(int i = 0;;) {
 #ifdef QT_DEBUG
         //Ensure the cell was not deleted yet and mark it as deleted
-        Q_ASSERT(!std::isnan(cells[idx].energy));
-        cells[idx].energy = DELETED_ENERGY;
+        Q_ASSERT(!std::isnan(cells.energy[idx]));
+        cells.energy[idx] = DELETED_ENERGY;
 #endif
-        const index_t left = cells[idx].neighbours[LEFT];
-        const index_t right = cells[idx].neighbours[RIGHT];
-        const index_t down = cells[idx].neighbours[DOWN];
+        const index_t left = cells.neighbours[LEFT][idx];
+        const index_t right = cells.neighbours[RIGHT][idx];
+        const index_t down = cells.neighbours[DOWN][idx];
+        seamMap.sewn.append(left);
+        seamMap.sewn.append(right);
         if(left != INVALID_INDEX) {
-            cells[left].neighbours[RIGHT] = right;
+            cells.neighbours[RIGHT][left] = right;
             updateEnergy(left);
         }
         if(right != INVALID_INDEX) {
-            cells[right].neighbours[LEFT] = left;
+            cells.neighbours[LEFT][right] = left;
             updateEnergy(right);
         }
         if(down == INVALID_INDEX) break;
         idx = seam[++i]; // Get next index from the seam
         if(idx != down) {
-            const index_t down_left = cells[down].neighbours[LEFT];
+            const index_t down_left = cells.neighbours[LEFT][down];
             if (idx == down_left) {
-                cells[down].neighbours[UP] = left;
-                cells[left].neighbours[DOWN] = down;
+                cells.neighbours[UP][down] = left;
+                cells.neighbours[DOWN][left] = down;
                 updateEnergy(left);
             } else {
-                Q_ASSERT (idx == cells[down].neighbours[RIGHT]);
-                cells[down].neighbours[UP] = right;
-                cells[right].neighbours[DOWN] = down;
+                Q_ASSERT (idx == cells.neighbours[RIGHT][down]);
+                cells.neighbours[UP][down] = right;
+                cells.neighbours[DOWN][right] = down;
                 updateEnergy(right);
             }
             updateEnergy(down);
         }
     }
     size.rwidth()--;
-    BENCHMARK_STOP();
+    if (seamMap.isUpToDate && seamMap.dir == DOWN)
+        repairSeamMap(RIGHT, DOWN);
+    else
+        seamMap.invalidate();
+}
+
+//Shifts the tail of every layout row left over the removed pixel
+void DtwImagePrivate::removeDenseSeam(const Seam& seam) {
+    cache.invalidate();
+    PROFILE_FUNCTION();
+    const int w = stride();
+    const int width = layoutSize().width();
+    const int height = layoutSize().height();
+    const bool isRepairable = seamMap.isUpToDate && seamMap.dir == DOWN;
+    QRgb * const colorsData = mutableColors();
+    energy_t * const energyData = cells.energy.data();
+    energy_t * const distTo = seamMap.distTo.data();
+    qint8 * const edgeTo = seamMap.edgeTo.data();
+    seamMap.sewn.resize(height);
+    for (int y = 0; y < height; y++) {
+        const int first = y*w;
+        const int x = seam[y] - first;
+        Q_ASSERT(x >= 0 && x < width);
+        seamMap.sewn[y] = x;
+        std::copy(colorsData + first + x + 1, colorsData + first + width, colorsData + first + x);
+        std::copy(energyData + first + x + 1, energyData + first + width, energyData + first + x);
+        if (isRepairable) {
+            std::copy(distTo + first + x + 1, distTo + first + width, distTo + first + x);
+            std::copy(edgeTo + first + x + 1, edgeTo + first + width, edgeTo + first + x);
+        }
+    }
+    if (isTransposed) size.rheight()--;
+    else size.rwidth()--;
+
+    //Only the pixels the seam was sewn between got new neighbours
+    for (int y = 0; y < height; y++) {
+        const int x = seamMap.sewn[y];
+        if (x > 0) updateDenseEnergy(x - 1, y);
+        if (x < width - 1) updateDenseEnergy(x, y);
+    }
+    if (isRepairable)
+        repairDenseSeamMap();
+    else
+        seamMap.invalidate();
+}
+
+//Per channel average, rounded down
+static inline QRgb average(QRgb a, QRgb b) {
+    return ((a ^ b) & 0xfefefefe) / 2 + (a & b);
+}
+
+//Carves "count" seams out of a working copy of the current image, then
+//writes the image with all of them doubled into a new buffer in one sweep
+//and starts over from it. A copy is the average of the seam pixel and the
+//next one along the layer.
+void DtwImagePrivate::insertSeams(int count, const Neighbour dir) {
+    PROFILE_FUNCTION();
+    StatisticsTimer timer(stats, &DtwImage::Statistics::seamInsertionTime);
+    const bool isVertical = (dir == DOWN);
+    const int width = size.width();
+    const int layerSize = isVertical ? size.width() : size.height();
+    const int length = isVertical ? size.height() : size.width();
+    Q_ASSERT(count > 0 && count < layerSize);
+
+    //Horizontal seams are carved as vertical seams of the transposed image:
+    //the energies and the search are symmetric, and walking the linked grid
+    //along its rows is several times faster than across them.
+    //Cell n*layerSize + j of the working copy is pixel j of layer n.
+    const QImage current = makeImage();
+    QImage carved = current;
+    if (!isVertical) {
+        carved = QImage(size.transposed(), DtwImage::DTW_FORMAT);
+        transposeTiles(reinterpret_cast<const QRgb *>(current.constBits()),
+                       current.bytesPerLine() / int(sizeof(QRgb)),
+                       reinterpret_cast<QRgb *>(carved.bits()),
+                       carved.bytesPerLine() / int(sizeof(QRgb)),
+                       size.width(), size.height());
+    }
+    QVector<quint8> isSeam(NM, 0);
+    //Buffers held next to this image until the end, the working copy shares carved
+    const qint64 heldBytes = bytes(current) + (isVertical ? 0 : bytes(carved)) + bytes(isSeam);
+    {
+        DtwImagePrivate work(q_ptr, carved, DtwImage::LINKED_GRID);
+        work.options = options;
+        for (int found = 0; found < count;) {
+            const QList<Seam> seams = work.findVerticalSeams(qMin(count - found, options.seamsPerPass));
+            foreach (const Seam& seam, seams) {
+                for (const index_t idx : seam)
+                    isSeam[isVertical ? idx : (idx % layerSize)*width + idx / layerSize] = 1;
+                work.removeVerticalSeam(seam);
+            }
+            found += seams.size();
+        }
+        notePeakBytes(heldBytes + work.cellBytes() + work.cacheBytes());
+    }
+
+    const QSize enlarged = isVertical ? QSize(size.width() + count, size.height())
+                                      : QSize(size.width(), size.height() + count);
+    QImage image(enlarged, DtwImage::DTW_FORMAT);
+    const int outStride = image.bytesPerLine() / int(sizeof(QRgb));
+    const int outNext = isVertical ? outStride : 1;
+    const int outAlong = isVertical ? 1 : outStride;
+    const int next = isVertical ? width : 1;
+    const int along = isVertical ? 1 : width;
+    const QRgb * const in = reinterpret_cast<const QRgb *>(current.constBits());
+    QRgb * const out = reinterpret_cast<QRgb *>(image.bits());
+    for (int n = 0; n < length; n++) {
+        QRgb * line = out + n*outNext;
+        for (int j = 0; j < layerSize; j++) {
+            const int k = n*next + j*along;
+            *line = in[k];
+            line += outAlong;
+            if (isSeam[k]) {
+                *line = average(in[k], (j < layerSize - 1) ? in[k + along] : in[k]);
+                line += outAlong;
+            }
+        }
+    }
+
+    //The enlarged image shares the output buffer and exists next to this one
+    DtwImagePrivate grown(q_ptr, image, backend);
+    notePeakBytes(heldBytes + grown.colorBytes() + grown.cellBytes());
+    const SeamOptions kept = options;
+    const StatisticsRecord keptStats = stats;
+    *this = std::move(grown);
+    options = kept;
+    stats = keptStats;
+    stats.add(&DtwImage::Statistics::seamsInserted, count);
+    notePeakBytes();
+}
+
+qint64 DtwImagePrivate::colorBytes() const {
+    return qint64(pixels.bytesPerLine()) * pixels.height();
+}
+
+qint64 DtwImagePrivate::cellBytes() const {
+    qint64 total = bytes(cells.energy);
+    for (const QVector<index_t>& links : cells.neighbours)
+        total += bytes(links);
+    return total;
+}
+
+//Memory of the rank cache, the seam map and the pyramid
+qint64 DtwImagePrivate::cacheBytes() const {
+    qint64 total = bytes(cache.ranks) + bytes(cache.histogram);
+    total += bytes(seamMap.distTo) + bytes(seamMap.edgeTo) + bytes(seamMap.marked)
+           + bytes(seamMap.fromCells) + bytes(seamMap.toCells)
+           + bytes(seamMap.fromDist) + bytes(seamMap.toDist)
+           + bytes(seamMap.rowEnergy) + bytes(seamMap.rowEdge)
+           + bytes(seamMap.dirty) + bytes(seamMap.nextDirty)
+           + bytes(seamMap.sewn) + bytes(seamMap.path);
+    for (const QVector<energy_t>& level : pyramid.levels)
+        total += bytes(level);
+    total += bytes(pyramid.path) + bytes(pyramid.coarsePath)
+           + bytes(pyramid.lo) + bytes(pyramid.hi)
+           + bytes(pyramid.fromDist) + bytes(pyramid.toDist)
+           + bytes(pyramid.rowEdge) + bytes(pyramid.edges);
+    return total;
+}
+
+void DtwImagePrivate::notePeakBytes(qint64 extra) const {
+    stats.notePeak(colorBytes() + cellBytes() + cacheBytes() + extra);
+}
+
+DtwImagePrivate::StatisticsRecord&
+DtwImagePrivate::StatisticsRecord::operator=(const StatisticsRecord& other) {
+    const DtwImage::Statistics copy = other.snapshot();
+    QMutexLocker locker(&mutex);
+    stats = copy;
+    return *this;
+}
+
+DtwImage::Statistics DtwImagePrivate::StatisticsRecord::snapshot() const {
+    QMutexLocker locker(&mutex);
+    return stats;
+}
+
+void DtwImagePrivate::StatisticsRecord::reset() {
+    QMutexLocker locker(&mutex);
+    stats = DtwImage::Statistics();
+}
+
+void DtwImagePrivate::StatisticsRecord::add(Total total, qint64 value) {
+    QMutexLocker locker(&mutex);
+    stats.*total += value;
+}
+
+void DtwImagePrivate::StatisticsRecord::add(Count count, int value) {
+    QMutexLocker locker(&mutex);
+    stats.*count += value;
+}
+
+void DtwImagePrivate::StatisticsRecord::notePeak(qint64 bytes) {
+    QMutexLocker locker(&mutex);
+    stats.peakBytes = qMax(stats.peakBytes, bytes);
+}
+
+void DtwImagePrivate::StatisticsRecord::merge(const DtwImage::Statistics& other) {
+    QMutexLocker locker(&mutex);
+    stats.constructionTime += other.constructionTime;
+    stats.energyTime += other.energyTime;
+    stats.thresholdTime += other.thresholdTime;
+    stats.seamSearchTime += other.seamSearchTime;
+    stats.seamRemovalTime += other.seamRemovalTime;
+    stats.seamInsertionTime += other.seamInsertionTime;
+    stats.rasterizationTime += other.rasterizationTime;
+    stats.seamSearches += other.seamSearches;
+    stats.seamsFound += other.seamsFound;
+    stats.seamsRemoved += other.seamsRemoved;
+    stats.seamsInserted += other.seamsInserted;
+    stats.peakBytes = qMax(stats.peakBytes, other.peakBytes);
 }
 
 void DtwImagePrivate::resize(const QSize& newSize) {
@@ -680,88 +1434,133 @@ void DtwImagePrivate::resize(const QSize& newSize) {
     const QSize deltaSize = newSize - size;
     int dh = deltaSize.height();
     int dw = deltaSize.width();
-    if ( dh > 0 || dw > 0) {
-        qWarning() << "Scaling up is not implemented yet";
+
+    //Seams of one pass are disjoint, so they can be removed one after another
+    while(dw < 0) {
+        QList<Seam> seams = findVerticalSeams(qMin(-dw, options.seamsPerPass));
+        if (isDense()) alignDenseSeams(seams);
+        foreach (const Seam& seam, seams)
+            removeVerticalSeam(seam);
+        dw += seams.size();
     }
 
-    while(dw++ < 0) {
-        removeVerticalSeam(findVerticalSeam());
+    //Doubling more than half of the seams at once would stretch them again
+    while(dw > 0) {
+        const int count = qMin(dw, qMax(1, size.width() / 2));
+        insertSeams(count, DOWN);
+        dw -= count;
     }
 
-    while(dh++ < 0) {
-        removeHorizontalSeam(findHorizontalSeam());
+    while(dh < 0) {
+        QList<Seam> seams = findHorizontalSeams(qMin(-dh, options.seamsPerPass));
+        if (isDense()) alignDenseSeams(seams);
+        foreach (const Seam& seam, seams)
+            removeHorizontalSeam(seam);
+        dh += seams.size();
     }
 
+    while(dh > 0) {
+        const int count = qMin(dh, qMax(1, size.height() / 2));
+        insertSeams(count, RIGHT);
+        dh -= count;
+    }
 }
 
 ////////////////////////////  Contour operations //////////////////////////////
 
-QPair<Seam, energy_t> DtwImagePrivate::findContour(index_t start, int minLength) const {
-    Q_ASSERT(start > INVALID_INDEX && minLength > 1);
-    BENCHMARK_START();
-
-    //Fill in the first layer with BFS
-    SeamLayer currentLayer(NM); //TODO: It's resonable to reserve less memory here.
-    QQueue<index_t> queue;
-    QVector<bool> visited(NM, false);
-    queue.enqueue(start);
-    visited[start] = true;
-    while(!queue.empty()) {
-        index_t idx = queue.dequeue();
-        currentLayer.add(idx, INVALID_INDEX, -cells[idx].energy);
-        std::for_each(cells[idx].neighbours.begin(), cells[idx].neighbours.end(),
-                     [&](index_t i) mutable {
-                        if(i != INVALID_INDEX && !visited[i]) {
-                            queue.enqueue(i);
-                            visited[i] = true;
-                        }});
-    }
-    //TODO: perhaps need to do squeeze() here
-    //Iterate throught the layers till the end
-    QList <SeamLayer> layers;
-    const int layerSize = currentLayer.size();
-    Q_ASSERT(layerSize == NM);
-    Seam candidateSeam;
-    energy_t candidateEnergy = 0.0;
-
-    for (int n = 0; n < layerSize; n++) {
-        qInfo() << n << " level";
-        SeamLayer nextLayer(currentLayer);
-        for (int idx = 0; idx < layerSize; idx++) {
-            const Cell& cell = cells[idx];
-            std::for_each(cell.neighbours.begin(), cell.neighbours.end(),
-                         [&](index_t i) mutable {
-                            if (i != INVALID_INDEX) {
-                                const index_t from = currentLayer.index(idx);
-                                const energy_t energy = currentLayer.dist(idx) - cells[i].energy; //negative
-                                if (i == idx) { //cycle found
-                                    qInfo() << "Cycle found";
-                                    if (n > minLength && energy < candidateEnergy) { //energy is stored as negative
-                                        candidateEnergy = energy;
-                                        //make candidate seam
-                                        candidateSeam.clear();
-                                        candidateSeam.reserve(n);
-                                        candidateSeam.prepend(idx);
-                                        index_t edgeTo = currentLayer.edge(idx);
-                                        auto it = layers.end();
-                                        while ( it-- != layers.begin()) {
-                                            qInfo() << "Candidate found";
-                                            candidateSeam.prepend(edgeTo);
-                                            edgeTo = it->edge(edgeTo);
-                                            Q_ASSERT(edgeTo != INVALID_INDEX);
-                                        }
-                                        Q_ASSERT(edgeTo == INVALID_INDEX);
-                                    }
-                                } else {
-                                    nextLayer.relax(i, idx, energy, from);
-                                }
-                            }});
-        }
-        layers.append(currentLayer);
-        currentLayer = nextLayer;
-     }
-
-    BENCHMARK_STOP();
-    return QPair<Seam, energy_t>(candidateSeam, -candidateEnergy);
+//Cell of every pixel of the carved image, row by row
+QVector<index_t> DtwImagePrivate::layoutCells() const {
+    const int width = size.width();
+    const int height = size.height();
+    QVector<index_t> ids(width * height);
+    if (isDense()) {
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                ids[y*width + x] = isTransposed ? x*stride() + y : y*stride() + x;
+        return ids;
+    }
+    index_t first = startingCell;
+    for (int y = 0; y < height; y++) {
+        index_t idx = first;
+        for (int x = 0; x < width; x++) {
+            ids[y*width + x] = idx;
+            idx = cells.neighbours[RIGHT][idx];
+        }
+        first = cells.neighbours[DOWN][first];
+    }
+    return ids;
+}
+
+//Outer borders of the 8-connected regions above the coloring page threshold.
+//Every region is labelled by a flood fill and its border followed once from
+//its first cell in raster order, so the search is linear in the cell count.
+QList<DtwImagePrivate::Contour> DtwImagePrivate::findAllCountours(float detailRatio, int minLength) const {
+    const energy_t threshold = getThresholdEnergy(detailRatio);
+    PROFILE_FUNCTION();
+    const int width = size.width();
+    const int height = size.height();
+    const QVector<index_t> ids = layoutCells();
+
+    //Labels get a background frame, so no neighbour needs a bounds check.
+    //0 is the background, -1 a region cell not labelled yet.
+    const int w = width + 2;
+    QVector<int> labels(w * (height + 2), 0);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            if (cells.energy[ids[y*width + x]] > threshold) labels[(y + 1)*w + x + 1] = -1;
+    //Clockwise from the east: E, SE, S, SW, W, NW, N, NE
+    const std::array<int, 8> steps = {{ 1, w + 1, w, w - 1, -1, -w - 1, -w, -w + 1 }};
+
+    QList<Contour> contours;
+    QVector<int> stack;
+    int label = 0;
+    for (int start = w; start < labels.size() - w; start++) {
+        if (labels[start] != -1) continue;
+        label++;
+        labels[start] = label;
+        stack.append(start);
+        while (!stack.isEmpty()) {
+            const int p = stack.takeLast();
+            for (const int step : steps) {
+                if (labels[p + step] == -1) {
+                    labels[p + step] = label;
+                    stack.append(p + step);
+                }
+            }
+        }
+
+        //Moore neighbour tracing. Cells west and north of the start are
+        //background, it is done once the start is left the first way again.
+        Contour contour;
+        contour.energy = 0.0;
+        int p = start;
+        int dir = 5;
+        int firstDir = -1;
+        for (;;) {
+            int d = dir;
+            int k = 0;
+            while (k < 8 && labels[p + steps[d]] == 0) {
+                d = (d + 1) % 8;
+                k++;
+            }
+            if (p == start) {
+                if (d == firstDir) break;
+                if (firstDir < 0) firstDir = d;
+            }
+            const int x = p % w - 1;
+            const int y = p / w - 1;
+            contour.outline.append(QPoint(x, y));
+            contour.energy += cells.energy[ids[y*width + x]];
+            if (k == 8) break; //A single cell
+            p += steps[d];
+            dir = (d % 2 == 0) ? (d + 7) % 8 : (d + 6) % 8;
+        }
+        if (contour.outline.size() >= minLength)
+            contours.append(contour);
+    }
+    std::stable_sort(contours.begin(), contours.end(), [](const Contour& a, const Contour& b) {
+        return a.energy > b.energy;
+    });
+    return contours;
 }
 
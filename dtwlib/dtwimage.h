@@ -22,26 +22,89 @@
 
 #include <QObject>
 #include <QImage>
+#include <QPolygon>
 
 namespace dtw {
 
 class DtwImagePrivate;
 
+//Thread safety: copies, clone(), resize() and statistics() may run on one
+//image from several threads at once. The coloring page and contour methods
+//fill caches of the image, and the setters and resetStatistics() change it,
+//so they need the image to themselves.
 class DtwImage: public QObject
 {
     Q_OBJECT
 public:
     static const QImage::Format DTW_FORMAT;
 
-    DtwImage(const QImage&);
+    //Storage of the carved image. LINKED_GRID unlinks removed pixels from a
+    //grid of neighbour links, DENSE_ROWS keeps packed rows and shifts them.
+    enum Backend { LINKED_GRID, DENSE_ROWS };
+
+    //Running totals of the work done on an image, copies carry them over
+    //and resize() adds its own. Times are in nanoseconds, memory is what
+    //the image holds when statistics() is called.
+    struct Statistics {
+        qint64 constructionTime;
+        qint64 energyTime;
+        qint64 thresholdTime;
+        qint64 seamSearchTime;
+        qint64 seamRemovalTime;
+        qint64 seamInsertionTime;
+        qint64 rasterizationTime;
+        int seamSearches;
+        int seamsFound;
+        int seamsRemoved;
+        int seamsInserted;
+        qint64 colorBytes;
+        qint64 cellBytes;
+        qint64 cacheBytes;
+        qint64 peakBytes;       //largest sum of the three above, working copies included
+
+        Statistics();
+    };
+
+    DtwImage(const QImage&, Backend backend = LINKED_GRID);
     DtwImage(const DtwImage&);
 
     ~DtwImage();
 
+    //Worker threads used by the library, QThread::idealThreadCount() by default.
+    //Non-positive values restore the default.
+    static int maxThreadCount();
+    static void setMaxThreadCount(int count);
+
+    Backend backend() const;
+
+    //Seams resize() takes from a single dynamic programming pass.
+    //1 (the default) gives the exact result, larger values trade quality for speed.
+    int seamsPerPass() const;
+    void setSeamsPerPass(int count);
+
+    //Coarse-to-fine seam search over an energy pyramid of the given number
+    //of levels, 1 (the default) is the exact search. Every finer level only
+    //refines the seam within "band" pixels of the one found a level above.
+    //Only DENSE_ROWS images use it, LINKED_GRID ones keep the exact search.
+    int pyramidLevels() const;
+    void setPyramidLevels(int levels);
+    int pyramidBand() const;
+    void setPyramidBand(int band);
+
+    Statistics statistics() const;
+    void resetStatistics();
+
     DtwImage clone() const;
     QImage resize(const QSize& rect) const;
     QImage makeColoringPage(int detailPercent = 0) const;
     QImage makeColoringPage(int detailPercent, const QSize& size) const;
+    //Pages of several detail levels from one pass over the energy ranks,
+    //rasterized side by side
+    QList<QImage> makeColoringPages(const QList<int>& detailPercents) const;
+
+    //Closed outlines of the strokes of the coloring page with the same detail,
+    //strongest first. Outlines of fewer than minLength pixels are dropped.
+    QList<QPolygon> findContours(int detailPercent = 0, int minLength = 3) const;
 
 #ifdef QT_DEBUG
     QImage dumpEnergy() const;
@@ -21,6 +21,9 @@
 
 #include "dtwimage.h"
 #include <QImage>
+#include <QPolygon>
+#include <QElapsedTimer>
+#include <QMutex>
 #include <QDebug>
 
 namespace dtw {
@@ -38,114 +41,160 @@ typedef std::array<Neighbour, 3> Directions;
 class DtwImagePrivate
 {
 
-struct Cell {
-        std::array<index_t, NEIGHBOUR_LAST> neighbours;
-        energy_t energy;
-        Cell();
-    };
+//Structure of arrays: energy-only passes stream through a contiguous
+//buffer instead of dragging the neighbour links through cache.
+//The dense backend has no links at all.
+struct Cells {
+    QVector<energy_t> energy;
+    std::array<QVector<index_t>, NEIGHBOUR_LAST> neighbours;
 
-class SeamLayer {
-protected:
-    QVector<index_t> indexes;
-    QVector<index_t> edgeTo;
+    Cells(int size, bool isLinked);
+    int size() const { return energy.size(); }
+};
+
+//Cumulative energies of the seam search, indexed by cell. They are kept
+//between searches and repaired around each removed seam.
+struct SeamMap {
+    bool isUpToDate;
+    Neighbour dir;                        //the direction seams run in
     QVector<energy_t> distTo;
+    QVector<qint8> edgeTo;                //-1/0/+1 step from the parent
+    QVector<quint8> marked;               //scratch flags, all clear between calls
+    QVector<index_t> fromCells, toCells;  //cells of the previous/current layer
+    QVector<energy_t> fromDist, toDist;   //rolling cumulative energies
+    QVector<energy_t> rowEnergy;          //energies of the current layer
+    QVector<qint8> rowEdge;
+    QVector<index_t> dirty, nextDirty;    //cells to recompute in the repair
+    QVector<index_t> sewn;                //two neighbours of each removed cell,
+                                          //or the removed column of each row when dense
+    QVector<index_t> path;
+
+    SeamMap() : isUpToDate(false), dir(DOWN) {}
+    void invalidate() { isUpToDate = false; }
+    void reserve(int cellCount, int layerSize, int length);
+};
+
+//Energy pyramid of the coarse-to-fine search and its scratch memory
+struct SeamPyramid {
+    Neighbour dir;
+    int age;                                  //seams found since the coarse levels were built
+    int requestedLevels;
+    QVector<QVector<energy_t>> levels;        //coarser levels, averaged 2x2 blocks
+    QVector<QSize> sizes;                     //layer size x layer count of every level
+    QVector<int> path, coarsePath;
+    QVector<int> lo, hi;                      //band of every layer
+    QVector<energy_t> fromDist, toDist;
+    QVector<qint8> rowEdge, edges;
+
+    SeamPyramid() : dir(DOWN), age(-1), requestedLevels(0) {}
+    void invalidate() { age = -1; }
+};
 
+struct SeamOptions {
+    int seamsPerPass;
+    int pyramidLevels;
+    int pyramidBand;
+
+    SeamOptions() : seamsPerPass(1), pyramidLevels(1), pyramidBand(4) {}
+};
+
+//Statistics of an image behind a lock. Const methods add to them, and
+//resize() may run on one image from several threads at once.
+class StatisticsRecord {
+    mutable QMutex mutex;
+    DtwImage::Statistics stats;
 public:
-    SeamLayer(size_t size) {
-        indexes.reserve(size);
-        edgeTo.reserve(size);
-        distTo.reserve(size);
-    }
-
-    SeamLayer(const SeamLayer& r)
-        : indexes(r.indexes), edgeTo(r.edgeTo), distTo(r.distTo) //We relay on Qt's "copy on write"
-    { }
-
-    void squeeze() { //Free excessive memory
-        indexes.squeeze();
-        edgeTo.squeeze();
-        distTo.squeeze();
-    }
-
-
-    void add(index_t i, index_t g, energy_t d) {
-        indexes.append(i);
-        edgeTo.append(g);
-        distTo.append(d);
-    }
-
-    void relax(index_t g, energy_t d) {
-        if (d < distTo.back()) {
-            edgeTo.back() = g;
-            distTo.back() = d;
-        }
-    }
-
-    void relax(index_t i, index_t g, energy_t d, index_t from) {
-        if (d < distTo[i]) {
-            edgeTo[i] = g;
-            distTo[i] = d;
-            indexes[i] = from;
-        }
-    }
-
-    int size() const {
-        Q_ASSERT(edgeTo.size() == distTo.size() && edgeTo.size() == indexes.size());
-        return edgeTo.size();
-    }
-
-    index_t edge(int i) const {
-        Q_ASSERT(i >= 0 && i < edgeTo.size());
-        return edgeTo[i];
-    }
-
-    energy_t dist(int i) const {
-        Q_ASSERT(i >= 0 && i < distTo.size());
-        return distTo[i];
-    }
-
-    energy_t index(int i) const {
-        Q_ASSERT(i >= 0 && i < indexes.size());
-        return indexes[i];
-    }
-
-    index_t getMinPathEdge() const;
+    typedef qint64 DtwImage::Statistics::* Total;
+    typedef int DtwImage::Statistics::* Count;
+
+    StatisticsRecord() {}
+    StatisticsRecord(const StatisticsRecord& other) : stats(other.snapshot()) {}
+    StatisticsRecord& operator=(const StatisticsRecord& other);
+
+    DtwImage::Statistics snapshot() const;
+    void reset();
+    void add(Total total, qint64 value);
+    void add(Count count, int value);
+    void notePeak(qint64 bytes);
+    //Adds the times and counts of "other", keeps the larger peak
+    void merge(const DtwImage::Statistics& other);
+};
 
+//Adds the time spent in its scope to a statistics total
+class StatisticsTimer {
+    StatisticsRecord& record;
+    const StatisticsRecord::Total total;
+    QElapsedTimer timer;
+public:
+    StatisticsTimer(StatisticsRecord& record, StatisticsRecord::Total total)
+        : record(record), total(total) { timer.start(); }
+    ~StatisticsTimer() { record.add(total, timer.nsecsElapsed()); }
 };
 
+//Quantized energy ranks, built once and kept until the cells change.
+//Any detail level becomes a compare against the 2-byte rank of each cell;
+//full energies are read only for cells sharing the threshold's rank.
 struct Cache {
     bool isUpToDate;
-    QList<energy_t> sortedEnergies;
+    energy_t rankScale;
+    QVector<quint16> ranks;
+    QVector<int> histogram; //histogram[r] is the number of cells ranked below r
 
-    Cache() : isUpToDate(false) {}
+    Cache() : isUpToDate(false), rankScale(0.0) {}
     void invalidate() { isUpToDate = false; }
+    int rank(energy_t e) const; //monotonic in e
 };
 
 public:
+    //A closed outline, clockwise, and the energy summed along it
+    struct Contour {
+        QPolygon outline;
+        energy_t energy;
+    };
+
     DtwImage * q_ptr;
     Q_DECLARE_PUBLIC(DtwImage)
 
     QSize size;
     int NM;
-    QVector<QRgb> colors;
-    QVector<Cell> cells;
+    DtwImage::Backend backend;
+    QImage pixels; //Contiguous DTW_FORMAT buffer, shares the source image until written
+    //Dense rows keep the source width as their stride, cell indexes are y*stride() + x
+    int stride() const { return pixels.width(); }
+    bool isDense() const { return backend == DtwImage::DENSE_ROWS; }
+    //Dense buffers are transposed while horizontal seams are worked on,
+    //so those run through the vertical seam code
+    bool isTransposed;
+    QSize layoutSize() const { return isTransposed ? size.transposed() : size; }
+    const QRgb * colors() const { return reinterpret_cast<const QRgb *>(pixels.constBits()); }
+    QRgb * mutableColors() { return reinterpret_cast<QRgb *>(pixels.bits()); }
+    Cells cells;
     index_t startingCell;
+    SeamOptions options;
 
     mutable Cache cache;
+    mutable SeamMap seamMap;
+    mutable SeamPyramid pyramid;
+    mutable StatisticsRecord stats;
 
-    DtwImagePrivate(DtwImage *q, QImage img);
+    DtwImagePrivate(DtwImage *q, const QImage& img, DtwImage::Backend backend);
     DtwImagePrivate(DtwImage *q, const DtwImagePrivate * r);
     DtwImagePrivate(DtwImage *q, const QSize& size);
 
     QImage makeImage() const;
     QImage makeHighEnergyImage(float detailRatio) const;
+    QList<QImage> makeHighEnergyImages(const QList<float>& detailRatios) const;
 
-    Seam findVerticalSeam() const;
-    Seam findHorizontalSeam() const;
-    Seam findSeamHelper(SeamLayer&& firstLayer, const Neighbour dir, int length) const;
+    Seam findVerticalSeam();
+    Seam findHorizontalSeam();
+    QList<Seam> findVerticalSeams(int count);
+    QList<Seam> findHorizontalSeams(int count);
+    QList<Seam> findSeamHelper(const Neighbour along, const Neighbour dir,
+                               int layerSize, int length, int count) const;
 
-    QList<Seam> findAllCountours( int minLength = 0, energy_t minEnergy = 0.0 ) const;
-    QPair<Seam, energy_t>  findContour(index_t start, int minLength = 3) const;
+    QList<Contour> findAllCountours(float detailRatio, int minLength = 3) const;
+    //The energy at position NM - NM/ratio of the sorted energies
+    energy_t getThresholdEnergy(float ratio, int * rank = 0) const;
 
 #ifdef QT_DEBUG
     void drawSeams();
@@ -154,15 +203,35 @@ public:
 
     void removeVerticalSeam(const Seam&);
     void removeHorizontalSeam(const Seam&);
-    void removeContour(const Seam&);
+    void removeDenseSeam(const Seam&);
+    void insertSeams(int count, const Neighbour dir);
 
     void resize(const QSize& size);
+    qint64 colorBytes() const;
+    qint64 cellBytes() const;
+    qint64 cacheBytes() const;
+    //Records the current footprint plus "extra" bytes held elsewhere in the peak
+    void notePeakBytes(qint64 extra = 0) const;
 
 private:
 
+    static QImage ingest(const QImage& img);
+    QVector<index_t> layoutCells() const;
+    void linkLine(int i);
+    void buildSeamMap(const Neighbour along, const Neighbour dir, int layerSize, int length) const;
+    void repairSeamMap(const Neighbour along, const Neighbour dir);
+    Seam traceSeam(index_t end, const Neighbour along, const Neighbour dir, int length) const;
+    Seam findPyramidSeam(const Neighbour dir, int layerSize, int length) const;
+    void buildDenseSeamMap(int layerSize, int length) const;
+    void repairDenseSeamMap();
+    void alignDenseSeams(QList<Seam>& seams) const;
+    void transposeDense(bool transposed);
     energy_t energy(int x, int y) const;
     void updateEnergy(index_t idx);
-    energy_t getThresholdEnergy(float ratio) const;
+    void updateDenseEnergy(int x, int y);
+    void updateCache() const;
+    //Touches neither the caches nor the statistics, safe to run side by side
+    QImage rasterize(energy_t threshold, int thresholdRank) const;
 
     energy_t dualGradientEnergy(int left, int rigth, int up, int down) const;
 
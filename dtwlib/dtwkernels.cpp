@@ -0,0 +1,523 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#include "dtwkernels.h"
+
+#include <QByteArray>
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DTW_X86_DISPATCH
+#include <immintrin.h>
+#define DTW_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+using namespace dtw;
+using namespace dtw::kernels;
+
+namespace {
+
+typedef void (*GradientFn)(const QRgb * left, const QRgb * right,
+                           const QRgb * up, const QRgb * down,
+                           double * energy, int count);
+
+typedef void (*ThresholdFn)(const quint16 * ranks, const double * energy, int count,
+                            int thresholdRank, double threshold, uchar * line);
+
+typedef void (*MinOfThreeFn)(const double * from, const double * energy, int count,
+                             double * to, qint8 * edge);
+
+//from[-1] and from[count] must be readable
+void minOfThreeScalar(const double * from, const double * energy, int count,
+                      double * to, qint8 * edge)
+{
+    for (int i = 0; i < count; i++) {
+        const double e = energy[i];
+        double dist = e + from[i];
+        qint8 step = 0;
+        if (e + from[i - 1] < dist) {
+            dist = e + from[i - 1];
+            step = -1;
+        }
+        if (e + from[i + 1] < dist) {
+            dist = e + from[i + 1];
+            step = 1;
+        }
+        to[i] = dist;
+        edge[i] = step;
+    }
+}
+
+void thresholdScalar(const quint16 * ranks, const double * energy, int count,
+                     int thresholdRank, double threshold, uchar * line)
+{
+    for (int i = 0; i < count; i++) {
+        const bool high = (ranks[i] > thresholdRank)
+                       || (ranks[i] == thresholdRank && energy[i] > threshold);
+        line[i] = high ? 0 : 255;
+    }
+}
+
+//Settles cells that tie with the threshold rank after a vector pass
+inline void thresholdTies(const quint16 * ranks, const double * energy, int count,
+                          int thresholdRank, double threshold, uchar * line)
+{
+    for (int i = 0; i < count; i++) {
+        if (ranks[i] == thresholdRank)
+            line[i] = (energy[i] > threshold) ? 0 : 255;
+    }
+}
+
+void gradientScalar(const QRgb * left, const QRgb * right,
+                    const QRgb * up, const QRgb * down,
+                    double * energy, int count)
+{
+    for (int i = 0; i < count; i++)
+        energy[i] = dualGradient(left[i], right[i], up[i], down[i]);
+}
+
+#ifdef DTW_X86_DISPATCH
+
+//All variants mask the alpha channel out, widen channels to 16 bit and let
+//madd square and pair-sum them. Squared sums are exact integers, so the
+//final double sqrt matches the scalar code bit for bit.
+
+DTW_TARGET("sse2")
+inline __m128i squaredDiff2Sse2(__m128i a, __m128i b, bool high)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i d = high ? _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero))
+                           : _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    return _mm_madd_epi16(d, d);
+}
+
+DTW_TARGET("sse2")
+inline __m128d sqrtPairSse2(__m128i s)
+{
+    s = _mm_add_epi32(s, _mm_srli_epi64(s, 32));
+    s = _mm_shuffle_epi32(s, _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm_sqrt_pd(_mm_cvtepi32_pd(s));
+}
+
+DTW_TARGET("sse2")
+void gradientSse2(const QRgb * left, const QRgb * right,
+                  const QRgb * up, const QRgb * down,
+                  double * energy, int count)
+{
+    const __m128i mask = _mm_set1_epi32(0x00ffffff);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i l = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(left + i)), mask);
+        const __m128i r = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(right + i)), mask);
+        const __m128i u = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(up + i)), mask);
+        const __m128i d = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(down + i)), mask);
+        const __m128i lo = _mm_add_epi32(squaredDiff2Sse2(l, r, false), squaredDiff2Sse2(u, d, false));
+        const __m128i hi = _mm_add_epi32(squaredDiff2Sse2(l, r, true), squaredDiff2Sse2(u, d, true));
+        _mm_storeu_pd(energy + i, sqrtPairSse2(lo));
+        _mm_storeu_pd(energy + i + 2, sqrtPairSse2(hi));
+    }
+    gradientScalar(left + i, right + i, up + i, down + i, energy + i, count - i);
+}
+
+DTW_TARGET("avx2")
+inline __m256i squaredDiff4Avx2(const QRgb * a, const QRgb * b)
+{
+    const __m128i mask = _mm_set1_epi32(0x00ffffff);
+    const __m128i va = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a)), mask);
+    const __m128i vb = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b)), mask);
+    const __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(va), _mm256_cvtepu8_epi16(vb));
+    return _mm256_madd_epi16(d, d);
+}
+
+DTW_TARGET("avx2")
+void gradientAvx2(const QRgb * left, const QRgb * right,
+                  const QRgb * up, const QRgb * down,
+                  double * energy, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i a = _mm256_add_epi32(squaredDiff4Avx2(left + i, right + i),
+                                           squaredDiff4Avx2(up + i, down + i));
+        const __m256i b = _mm256_add_epi32(squaredDiff4Avx2(left + i + 4, right + i + 4),
+                                           squaredDiff4Avx2(up + i + 4, down + i + 4));
+        //hadd pairs within 128-bit lanes: [p0 p1 p4 p5 | p2 p3 p6 p7]
+        const __m256i s = _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_pd(energy + i, _mm256_sqrt_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(s))));
+        _mm256_storeu_pd(energy + i + 4, _mm256_sqrt_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(s, 1))));
+    }
+    gradientScalar(left + i, right + i, up + i, down + i, energy + i, count - i);
+}
+
+DTW_TARGET("avx512f,avx512bw")
+inline __m512i squaredDiff8Avx512(const QRgb * a, const QRgb * b)
+{
+    const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+    const __m256i va = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a)), mask);
+    const __m256i vb = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(b)), mask);
+    const __m512i d = _mm512_sub_epi16(_mm512_cvtepu8_epi16(va), _mm512_cvtepu8_epi16(vb));
+    return _mm512_madd_epi16(d, d);
+}
+
+//The AVX-512 variants use the zero-masked forms with every lane set where the
+//plain ones pass an undefined vector through, which GCC 12 reports as
+//maybe-uninitialized. They compile to the same instructions.
+DTW_TARGET("avx512f,avx512bw")
+void gradientAvx512(const QRgb * left, const QRgb * right,
+                    const QRgb * up, const QRgb * down,
+                    double * energy, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m512i s = _mm512_add_epi32(squaredDiff8Avx512(left + i, right + i),
+                                     squaredDiff8Avx512(up + i, down + i));
+        //Low dword of every qword now holds one pixel's sum
+        s = _mm512_add_epi32(s, _mm512_maskz_srli_epi64(0xff, s, 32));
+        const __m256i sums = _mm512_maskz_cvtepi64_epi32(0xff, s);
+        _mm512_storeu_pd(energy + i, _mm512_maskz_sqrt_pd(0xff, _mm512_maskz_cvtepi32_pd(0xff, sums)));
+    }
+    gradientScalar(left + i, right + i, up + i, down + i, energy + i, count - i);
+}
+
+//Ranks are unsigned, so they are biased into signed range for the compares
+DTW_TARGET("sse2")
+void thresholdSse2(const quint16 * ranks, const double * energy, int count,
+                   int thresholdRank, double threshold, uchar * line)
+{
+    const __m128i bias = _mm_set1_epi16(short(0x8000));
+    const __m128i limit = _mm_xor_si128(_mm_set1_epi16(short(thresholdRank)), bias);
+    const __m128i ones = _mm_set1_epi8(char(0xff));
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i lo = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ranks + i)), bias);
+        const __m128i hi = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ranks + i + 8)), bias);
+        const __m128i high = _mm_packs_epi16(_mm_cmpgt_epi16(lo, limit), _mm_cmpgt_epi16(hi, limit));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(line + i), _mm_andnot_si128(high, ones));
+        const __m128i ties = _mm_packs_epi16(_mm_cmpeq_epi16(lo, limit), _mm_cmpeq_epi16(hi, limit));
+        if (_mm_movemask_epi8(ties))
+            thresholdTies(ranks + i, energy + i, 16, thresholdRank, threshold, line + i);
+    }
+    thresholdScalar(ranks + i, energy + i, count - i, thresholdRank, threshold, line + i);
+}
+
+DTW_TARGET("avx2")
+void thresholdAvx2(const quint16 * ranks, const double * energy, int count,
+                   int thresholdRank, double threshold, uchar * line)
+{
+    const __m256i bias = _mm256_set1_epi16(short(0x8000));
+    const __m256i limit = _mm256_xor_si256(_mm256_set1_epi16(short(thresholdRank)), bias);
+    const __m256i ones = _mm256_set1_epi8(char(0xff));
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i lo = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(ranks + i)), bias);
+        const __m256i hi = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(ranks + i + 16)), bias);
+        //packs works within 128-bit lanes, the permute restores the order
+        const __m256i high = _mm256_permute4x64_epi64(
+                    _mm256_packs_epi16(_mm256_cmpgt_epi16(lo, limit), _mm256_cmpgt_epi16(hi, limit)),
+                    _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(line + i), _mm256_andnot_si256(high, ones));
+        const __m256i ties = _mm256_or_si256(_mm256_cmpeq_epi16(lo, limit), _mm256_cmpeq_epi16(hi, limit));
+        if (_mm256_movemask_epi8(ties))
+            thresholdTies(ranks + i, energy + i, 32, thresholdRank, threshold, line + i);
+    }
+    thresholdScalar(ranks + i, energy + i, count - i, thresholdRank, threshold, line + i);
+}
+
+DTW_TARGET("avx512f,avx512bw")
+void thresholdAvx512(const quint16 * ranks, const double * energy, int count,
+                     int thresholdRank, double threshold, uchar * line)
+{
+    const __m512i limit = _mm512_set1_epi16(short(thresholdRank));
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m512i r = _mm512_loadu_si512(ranks + i);
+        const __mmask32 high = _mm512_cmpgt_epu16_mask(r, limit);
+        const __m512i ink = _mm512_movm_epi16(high);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(line + i),
+                            _mm256_xor_si256(_mm512_maskz_cvtepi16_epi8(0xffffffff, ink),
+                                             _mm256_set1_epi8(char(0xff))));
+        if (_mm512_cmpeq_epu16_mask(r, limit))
+            thresholdTies(ranks + i, energy + i, 32, thresholdRank, threshold, line + i);
+    }
+    thresholdScalar(ranks + i, energy + i, count - i, thresholdRank, threshold, line + i);
+}
+
+//The vector variants add before they compare and test the candidates in the
+//scalar order with strict compares, so ties and rounding match it exactly.
+//Lane masks turn into -1/0/+1 steps through a bit-to-byte table.
+struct ByteMasks {
+    quint64 bytes[256];
+    ByteMasks() {
+        for (int m = 0; m < 256; m++) {
+            bytes[m] = 0;
+            for (int k = 0; k < 8; k++)
+                if (m & (1 << k)) bytes[m] |= quint64(1) << (8*k);
+        }
+    }
+} const byteMasks;
+
+inline void storeSteps(qint8 * edge, int lanes, unsigned left, unsigned right)
+{
+    const quint64 * const bytes = byteMasks.bytes;
+    //0xff per left lane is -1, right wins over left
+    const quint64 steps = bytes[right] | (bytes[left & ~right] * 0xff);
+    memcpy(edge, &steps, lanes);
+}
+
+DTW_TARGET("sse2")
+void minOfThreeSse2(const double * from, const double * energy, int count,
+                    double * to, qint8 * edge)
+{
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        const __m128d e = _mm_loadu_pd(energy + i);
+        __m128d dist = _mm_add_pd(e, _mm_loadu_pd(from + i));
+        const __m128d left = _mm_add_pd(e, _mm_loadu_pd(from + i - 1));
+        const __m128d isLeft = _mm_cmplt_pd(left, dist);
+        dist = _mm_or_pd(_mm_and_pd(isLeft, left), _mm_andnot_pd(isLeft, dist));
+        const __m128d right = _mm_add_pd(e, _mm_loadu_pd(from + i + 1));
+        const __m128d isRight = _mm_cmplt_pd(right, dist);
+        dist = _mm_or_pd(_mm_and_pd(isRight, right), _mm_andnot_pd(isRight, dist));
+        _mm_storeu_pd(to + i, dist);
+        storeSteps(edge + i, 2, _mm_movemask_pd(isLeft), _mm_movemask_pd(isRight));
+    }
+    minOfThreeScalar(from + i, energy + i, count - i, to + i, edge + i);
+}
+
+DTW_TARGET("avx2")
+void minOfThreeAvx2(const double * from, const double * energy, int count,
+                    double * to, qint8 * edge)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256d e = _mm256_loadu_pd(energy + i);
+        __m256d dist = _mm256_add_pd(e, _mm256_loadu_pd(from + i));
+        const __m256d left = _mm256_add_pd(e, _mm256_loadu_pd(from + i - 1));
+        const __m256d isLeft = _mm256_cmp_pd(left, dist, _CMP_LT_OQ);
+        dist = _mm256_blendv_pd(dist, left, isLeft);
+        const __m256d right = _mm256_add_pd(e, _mm256_loadu_pd(from + i + 1));
+        const __m256d isRight = _mm256_cmp_pd(right, dist, _CMP_LT_OQ);
+        dist = _mm256_blendv_pd(dist, right, isRight);
+        _mm256_storeu_pd(to + i, dist);
+        storeSteps(edge + i, 4, _mm256_movemask_pd(isLeft), _mm256_movemask_pd(isRight));
+    }
+    minOfThreeScalar(from + i, energy + i, count - i, to + i, edge + i);
+}
+
+DTW_TARGET("avx512f,avx512bw")
+void minOfThreeAvx512(const double * from, const double * energy, int count,
+                      double * to, qint8 * edge)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m512d e = _mm512_loadu_pd(energy + i);
+        __m512d dist = _mm512_add_pd(e, _mm512_loadu_pd(from + i));
+        const __m512d left = _mm512_add_pd(e, _mm512_loadu_pd(from + i - 1));
+        const __mmask8 isLeft = _mm512_cmp_pd_mask(left, dist, _CMP_LT_OQ);
+        dist = _mm512_mask_blend_pd(isLeft, dist, left);
+        const __m512d right = _mm512_add_pd(e, _mm512_loadu_pd(from + i + 1));
+        const __mmask8 isRight = _mm512_cmp_pd_mask(right, dist, _CMP_LT_OQ);
+        dist = _mm512_mask_blend_pd(isRight, dist, right);
+        _mm512_storeu_pd(to + i, dist);
+        storeSteps(edge + i, 8, isLeft, isRight);
+    }
+    minOfThreeScalar(from + i, energy + i, count - i, to + i, edge + i);
+}
+
+Isa detectIsa()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return ISA_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return ISA_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return ISA_SSE2;
+    return ISA_SCALAR;
+}
+
+#else
+
+Isa detectIsa()
+{
+    return ISA_SCALAR;
+}
+
+#endif
+
+Isa selectIsa()
+{
+    Isa isa = detectIsa();
+    const QByteArray cap = qgetenv("DTW_SIMD");
+    if (cap == "scalar")
+        isa = ISA_SCALAR;
+    else if (cap == "sse2")
+        isa = qMin(isa, ISA_SSE2);
+    else if (cap == "avx2")
+        isa = qMin(isa, ISA_AVX2);
+    else if (cap == "avx512")
+        isa = qMin(isa, ISA_AVX512);
+    return isa;
+}
+
+GradientFn selectGradient(Isa isa)
+{
+    switch (isa) {
+#ifdef DTW_X86_DISPATCH
+    case ISA_AVX512: return gradientAvx512;
+    case ISA_AVX2:   return gradientAvx2;
+    case ISA_SSE2:   return gradientSse2;
+#endif
+    default:         return gradientScalar;
+    }
+}
+
+ThresholdFn selectThreshold(Isa isa)
+{
+    switch (isa) {
+#ifdef DTW_X86_DISPATCH
+    case ISA_AVX512: return thresholdAvx512;
+    case ISA_AVX2:   return thresholdAvx2;
+    case ISA_SSE2:   return thresholdSse2;
+#endif
+    default:         return thresholdScalar;
+    }
+}
+
+MinOfThreeFn selectMinOfThree(Isa isa)
+{
+    switch (isa) {
+#ifdef DTW_X86_DISPATCH
+    case ISA_AVX512: return minOfThreeAvx512;
+    case ISA_AVX2:   return minOfThreeAvx2;
+    case ISA_SSE2:   return minOfThreeSse2;
+#endif
+    default:         return minOfThreeScalar;
+    }
+}
+
+void gradientRow(GradientFn gradient, const QRgb * up, const QRgb * line, const QRgb * down,
+                 int width, double * energy)
+{
+    Q_ASSERT(width > 1);
+    energy[0] = dualGradient(line[0], line[1], up[0], down[0]);
+    gradient(line, line + 2, up + 1, down + 1, energy + 1, width - 2);
+    energy[width - 1] = dualGradient(line[width - 2], line[width - 1], up[width - 1], down[width - 1]);
+}
+
+void seamSpan(MinOfThreeFn relax, const double * from, const double * energy, int count,
+              int begin, int end, double * to, qint8 * edge)
+{
+    Q_ASSERT(count > 1 && 0 <= begin && begin <= end && end <= count);
+    if (begin == end) return;
+    //Border columns have one parent less
+    if (begin == 0) {
+        to[0] = energy[0] + from[0];
+        edge[0] = 0;
+        if (energy[0] + from[1] < to[0]) {
+            to[0] = energy[0] + from[1];
+            edge[0] = 1;
+        }
+        begin = 1;
+    }
+    const bool isLast = (end == count);
+    if (isLast) end--;
+    if (begin < end)
+        relax(from + begin, energy + begin, end - begin, to + begin, edge + begin);
+    if (isLast) {
+        const int j = count - 1;
+        to[j] = energy[j] + from[j];
+        edge[j] = 0;
+        if (energy[j] + from[j - 1] < to[j]) {
+            to[j] = energy[j] + from[j - 1];
+            edge[j] = -1;
+        }
+    }
+}
+
+}//namespace
+
+Isa kernels::activeIsa()
+{
+    static const Isa isa = selectIsa();
+    return isa;
+}
+
+const char * kernels::isaName(Isa isa)
+{
+    switch (isa) {
+    case ISA_AVX512: return "avx512";
+    case ISA_AVX2:   return "avx2";
+    case ISA_SSE2:   return "sse2";
+    default:         return "scalar";
+    }
+}
+
+bool kernels::isSupported(Isa isa)
+{
+    static const Isa detected = detectIsa();
+    return isa <= detected;
+}
+
+void kernels::dualGradientRow(const QRgb * up, const QRgb * line, const QRgb * down,
+                              int width, double * energy)
+{
+    static const GradientFn gradient = selectGradient(activeIsa());
+    gradientRow(gradient, up, line, down, width, energy);
+}
+
+void kernels::thresholdRow(const quint16 * ranks, const double * energy, int count,
+                           int thresholdRank, double threshold, uchar * line)
+{
+    static const ThresholdFn classify = selectThreshold(activeIsa());
+    classify(ranks, energy, count, thresholdRank, threshold, line);
+}
+
+void kernels::seamRow(const double * from, const double * energy, int count,
+                      double * to, qint8 * edge)
+{
+    seamRowSpan(from, energy, count, 0, count, to, edge);
+}
+
+void kernels::seamRowSpan(const double * from, const double * energy, int count,
+                          int begin, int end, double * to, qint8 * edge)
+{
+    static const MinOfThreeFn relax = selectMinOfThree(activeIsa());
+    seamSpan(relax, from, energy, count, begin, end, to, edge);
+}
+
+void kernels::dualGradientRow(Isa isa, const QRgb * up, const QRgb * line, const QRgb * down,
+                              int width, double * energy)
+{
+    Q_ASSERT(isSupported(isa));
+    gradientRow(selectGradient(isa), up, line, down, width, energy);
+}
+
+void kernels::thresholdRow(Isa isa, const quint16 * ranks, const double * energy, int count,
+                           int thresholdRank, double threshold, uchar * line)
+{
+    Q_ASSERT(isSupported(isa));
+    selectThreshold(isa)(ranks, energy, count, thresholdRank, threshold, line);
+}
+
+void kernels::seamRowSpan(Isa isa, const double * from, const double * energy, int count,
+                          int begin, int end, double * to, qint8 * edge)
+{
+    Q_ASSERT(isSupported(isa));
+    seamSpan(selectMinOfThree(isa), from, energy, count, begin, end, to, edge);
+}
@@ -0,0 +1,87 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#ifndef DTWKERNELS_H
+#define DTWKERNELS_H
+
+#include <QtGlobal>
+#include <QRgb>
+
+#include <cmath>
+
+namespace dtw {
+namespace kernels {
+
+//Instruction sets the hot loops are compiled for. The best one supported by
+//the running CPU is picked once; DTW_SIMD=scalar|sse2|avx2|avx512 caps it.
+enum Isa { ISA_SCALAR, ISA_SSE2, ISA_AVX2, ISA_AVX512 };
+
+Isa activeIsa();
+const char * isaName(Isa isa);
+//Whether the running CPU has "isa", DTW_SIMD aside
+bool isSupported(Isa isa);
+
+//Dual gradient energy of a pixel given its four neighbours.
+//The SIMD variants are bit-identical to this one.
+inline double dualGradient(QRgb left, QRgb right, QRgb up, QRgb down) {
+    const int dRx = qRed(left)   - qRed(right);
+    const int dGx = qGreen(left) - qGreen(right);
+    const int dBx = qBlue(left)  - qBlue(right);
+    const int dRy = qRed(up)     - qRed(down);
+    const int dGy = qGreen(up)   - qGreen(down);
+    const int dBy = qBlue(up)    - qBlue(down);
+
+    const int Dx2 = dRx*dRx + dGx*dGx + dBx*dBx;
+    const int Dy2 = dRy*dRy + dGy*dGy + dBy*dBy;
+
+    return std::sqrt(double(Dx2 + Dy2));
+}
+
+//Energy of a whole scanline. Border pixels use themselves in place of the
+//missing neighbour, so pass "line" as "up"/"down" for the first/last row.
+void dualGradientRow(const QRgb * up, const QRgb * line, const QRgb * down,
+                     int width, double * energy);
+
+//Coloring page scanline: 0 (ink) for cells above the threshold, 255 for
+//the rest. Ranks decide on their own unless a cell shares the threshold's
+//rank, only then its energy is compared.
+void thresholdRow(const quint16 * ranks, const double * energy, int count,
+                  int thresholdRank, double threshold, uchar * line);
+
+//One layer of the seam dynamic program: to[j] is energy[j] plus the
+//cheapest of from[j], from[j-1], from[j+1] (first one wins on ties) and
+//edge[j] is the -1/0/+1 step to it.
+void seamRow(const double * from, const double * energy, int count,
+             double * to, qint8 * edge);
+
+//seamRow() restricted to columns [begin, end) of a row "count" columns wide
+void seamRowSpan(const double * from, const double * energy, int count,
+                 int begin, int end, double * to, qint8 * edge);
+
+//The same kernels for a given supported instruction set instead of the
+//active one, so every variant can be checked against the scalar code
+void dualGradientRow(Isa isa, const QRgb * up, const QRgb * line, const QRgb * down,
+                     int width, double * energy);
+void thresholdRow(Isa isa, const quint16 * ranks, const double * energy, int count,
+                  int thresholdRank, double threshold, uchar * line);
+void seamRowSpan(Isa isa, const double * from, const double * energy, int count,
+                 int begin, int end, double * to, qint8 * edge);
+
+}//namespace kernels
+}//namespace dtw
+#endif // DTWKERNELS_H
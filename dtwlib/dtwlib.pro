@@ -25,11 +25,16 @@ TARGET = dtw
 TEMPLATE = lib
 #CONFIG += staticlib
 
-SOURCES += dtwimage.cpp
+SOURCES += dtwimage.cpp \
+    dtwkernels.cpp \
+    dtwparallel.cpp \
+    dtwprofiler.cpp
 
 HEADERS += dtwimage.h \
     dtwimage_p.h \
-    benchmark.h
+    dtwkernels.h \
+    dtwparallel.h \
+    dtwprofiler.h
 unix {
     target.path = /usr/lib
     INSTALLS += target
@@ -0,0 +1,93 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#include "dtwparallel.h"
+#include "dtwprofiler.h"
+
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QThread>
+#include <QThreadPool>
+
+using namespace dtw;
+
+namespace {
+
+QThreadPool * pool()
+{
+    static QThreadPool instance;
+    return &instance;
+}
+
+struct BandJob {
+    const std::function<void(int, int)> body;
+    const int count;
+    const int bands;
+    QAtomicInt next;
+    QSemaphore done;
+
+    BandJob(const std::function<void(int, int)>& body, int count, int bands)
+        : body(body), count(count), bands(bands), next(0) {}
+
+    void run() {
+        int band;
+        while ((band = next.fetchAndAddRelaxed(1)) < bands) {
+            PROFILE_SCOPE("parallel::forBands band");
+            body(int(qint64(count) * band / bands), int(qint64(count) * (band + 1) / bands));
+            done.release();
+        }
+    }
+};
+
+//Helpers which start after the caller has drained the job find nothing to do
+class BandRunner : public QRunnable {
+    QSharedPointer<BandJob> job;
+public:
+    BandRunner(const QSharedPointer<BandJob>& job) : job(job) {}
+    void run() { job->run(); }
+};
+
+}//namespace
+
+int parallel::maxThreadCount()
+{
+    return pool()->maxThreadCount();
+}
+
+void parallel::setMaxThreadCount(int count)
+{
+    pool()->setMaxThreadCount(count > 0 ? count : QThread::idealThreadCount());
+}
+
+void parallel::forBands(int count, int minBand, const std::function<void(int, int)>& body)
+{
+    if (count <= 0) return;
+    const int bands = qMax(1, qMin(maxThreadCount(), count / qMax(1, minBand)));
+    if (bands == 1) {
+        body(0, count);
+        return;
+    }
+
+    QSharedPointer<BandJob> job(new BandJob(body, count, bands));
+    for (int i = 1; i < bands; i++)
+        pool()->start(new BandRunner(job));
+    job->run();
+    job->done.acquire(bands);
+}
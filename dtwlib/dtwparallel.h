@@ -0,0 +1,37 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#ifndef DTWPARALLEL_H
+#define DTWPARALLEL_H
+
+#include <functional>
+
+namespace dtw {
+namespace parallel {
+
+int maxThreadCount();
+void setMaxThreadCount(int count);
+
+//Splits [0, count) into contiguous bands of at least minBand items and runs
+//body(begin, end) for each of them on the library thread pool. The calling
+//thread takes part in the work, so nested calls cannot starve the pool.
+void forBands(int count, int minBand, const std::function<void(int, int)>& body);
+
+}//namespace parallel
+}//namespace dtw
+#endif // DTWPARALLEL_H
@@ -0,0 +1,525 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#include "dtwprofiler.h"
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSharedPointer>
+#include <QVector>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+//Allocations are traced by wrapping glibc's allocator. That costs every
+//allocation of the process, so it is opt-in with -DDTW_TRACE_ALLOCATIONS and
+//left out of sanitizer builds, which bring their own allocator.
+#if defined(BENCH) && defined(DTW_TRACE_ALLOCATIONS) && defined(__GLIBC__)
+#include <malloc.h>
+#define DTW_WRAP_ALLOCATOR
+#endif
+
+using namespace dtw;
+
+static const int MAX_SAMPLES = 1024;   //per node, reservoir sampled beyond that
+static const int MAX_EVENTS = 1 << 20; //per process, later ones are dropped
+
+namespace {
+
+//Heap counters of the calling thread. They are plain thread locals, so the
+//allocator can update them without allocating itself.
+#ifdef DTW_WRAP_ALLOCATOR
+#define DTW_TLS thread_local __attribute__((tls_model("initial-exec")))
+#else
+#define DTW_TLS thread_local
+#endif
+DTW_TLS qint64 allocatedBytes;  //ever allocated
+DTW_TLS qint64 liveBytes;       //allocated minus freed
+DTW_TLS qint64 peakBytes;       //highest liveBytes since the innermost scope opened
+DTW_TLS bool isBookkeeping;     //the profiler's own allocations are not counted
+DTW_TLS profiler::ThreadData * threadData;
+
+//Keeps the profiler's own allocations out of the counters
+struct Bookkeeping {
+    const bool outer;
+    Bookkeeping() : outer(isBookkeeping) { isBookkeeping = true; }
+    ~Bookkeeping() { isBookkeeping = outer; }
+};
+
+}//namespace
+
+namespace dtw {
+namespace profiler {
+
+struct Node {
+    const char * name;
+    int parent;
+    QVector<int> children;
+    qint64 calls;
+    qint64 total;
+    qint64 min;
+    qint64 max;
+    qint64 allocated;
+    qint64 peak;
+    QVector<qint64> samples;
+
+    Node(const char * name = 0, int parent = -1) : name(name), parent(parent) { clear(); }
+    void clear() {
+        calls = total = allocated = peak = max = 0;
+        min = std::numeric_limits<qint64>::max();
+        samples.clear();
+    }
+};
+
+struct Event {
+    const char * name;
+    int thread;
+    qint64 start;
+    qint64 duration;
+};
+
+//Written by its own thread only, the mutex is there for the readers
+struct ThreadData {
+    QMutex mutex;
+    int id;
+    QVector<Node> nodes; //nodes[0] is the root
+    int current;
+    QVector<Event> events;
+    quint32 random;
+
+    ThreadData(int id) : id(id), current(0), random(id + 1) { nodes.append(Node()); }
+    void merge(const ThreadData& other, int from = 0, int into = 0);
+};
+
+//Adds the subtree of other under from to the one of this thread under into,
+//the events are left to the caller
+void ThreadData::merge(const ThreadData& other, int from, int into)
+{
+    foreach (int child, other.nodes[from].children) {
+        const Node& source = other.nodes[child];
+        int target = -1;
+        foreach (int candidate, nodes[into].children) {
+            if (std::strcmp(nodes[candidate].name, source.name) == 0) {
+                target = candidate;
+                break;
+            }
+        }
+        if (target < 0) {
+            target = nodes.size();
+            nodes.append(Node(source.name, into));
+            nodes[into].children.append(target);
+        }
+        Node& n = nodes[target];
+        n.calls += source.calls;
+        n.total += source.total;
+        n.min = qMin(n.min, source.min);
+        n.max = qMax(n.max, source.max);
+        n.allocated += source.allocated;
+        n.peak = qMax(n.peak, source.peak);
+        for (int i = 0; i < source.samples.size() && n.samples.size() < MAX_SAMPLES; i++)
+            n.samples.append(source.samples[i]);
+        merge(other, child, target);
+    }
+}
+
+}//namespace profiler
+}//namespace dtw
+
+namespace {
+
+struct Registry {
+    QMutex mutex;
+    QList<QSharedPointer<profiler::ThreadData>> threads;
+    //Threads that exited are folded in here, pool threads come and go
+    profiler::ThreadData retired;
+    int nextId;
+    QElapsedTimer clock;
+    QAtomicInt enabled;
+    QAtomicInt events;
+
+    Registry()
+        : retired(0), nextId(1), enabled(!qgetenv("DTW_PROFILE").isEmpty()), events(0)
+    { clock.start(); }
+    ~Registry();
+};
+
+bool isRegistryDestroyed = false;
+
+Registry& registry()
+{
+    static Registry instance;
+    return instance;
+}
+
+//Retires the data of the thread when it exits
+struct ThreadExit {
+    ~ThreadExit();
+};
+thread_local ThreadExit threadExit;
+
+ThreadExit::~ThreadExit()
+{
+    if (!threadData || isRegistryDestroyed) return;
+    Bookkeeping bookkeeping;
+    Registry& r = registry();
+    QMutexLocker lock(&r.mutex);
+    for (int i = 0; i < r.threads.size(); i++) {
+        if (r.threads[i].data() != threadData) continue;
+        QSharedPointer<profiler::ThreadData> data = r.threads.takeAt(i);
+        QMutexLocker threadLock(&data->mutex);
+        r.retired.merge(*data);
+        //They were counted against the cap of registry().events when recorded
+        r.retired.events += data->events;
+        break;
+    }
+    threadData = 0;
+}
+
+profiler::ThreadData * currentThread()
+{
+    if (!threadData) {
+        Registry& r = registry();
+        QMutexLocker lock(&r.mutex);
+        QSharedPointer<profiler::ThreadData> data(new profiler::ThreadData(r.nextId++));
+        r.threads.append(data);
+        threadData = data.data();
+        (void)&threadExit; //registers the destructor of this thread
+    }
+    return threadData;
+}
+
+void appendEscaped(QByteArray& out, const char * text)
+{
+    out.append('"');
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') out.append('\\');
+        if (uchar(*text) >= 0x20) out.append(*text);
+    }
+    out.append('"');
+}
+
+QByteArray micros(qint64 ns)
+{
+    return QByteArray::number(ns / 1000.0, 'f', 3);
+}
+
+qint64 percentile(const QVector<qint64>& sorted, int p)
+{
+    if (sorted.isEmpty()) return 0;
+    return sorted[qMin(sorted.size() - 1, sorted.size() * p / 100)];
+}
+
+void appendNode(QByteArray& out, const profiler::ThreadData& data, int index)
+{
+    const profiler::Node& node = data.nodes[index];
+    QVector<qint64> sorted = node.samples;
+    std::sort(sorted.begin(), sorted.end());
+    out.append("{\"name\":");
+    appendEscaped(out, node.name);
+    out.append(",\"calls\":").append(QByteArray::number(node.calls));
+    out.append(",\"totalUs\":").append(micros(node.total));
+    out.append(",\"minUs\":").append(micros(node.calls ? node.min : 0));
+    out.append(",\"meanUs\":").append(micros(node.calls ? node.total / node.calls : 0));
+    out.append(",\"maxUs\":").append(micros(node.max));
+    out.append(",\"p50Us\":").append(micros(percentile(sorted, 50)));
+    out.append(",\"p90Us\":").append(micros(percentile(sorted, 90)));
+    out.append(",\"p99Us\":").append(micros(percentile(sorted, 99)));
+    out.append(",\"allocatedBytes\":").append(QByteArray::number(node.allocated));
+    out.append(",\"peakBytes\":").append(QByteArray::number(node.peak));
+    out.append(",\"children\":[");
+    for (int i = 0; i < node.children.size(); i++) {
+        if (i > 0) out.append(',');
+        appendNode(out, data, node.children[i]);
+    }
+    out.append("]}");
+}
+
+void writeFile(const QByteArray& fileName, const QByteArray& content)
+{
+    QFile file(QString::fromLocal8Bit(fileName));
+    if (file.open(QIODevice::WriteOnly))
+        file.write(content);
+}
+
+//Writes the dumps asked for by DTW_PROFILE on the way out
+Registry::~Registry()
+{
+#ifdef BENCH
+    const QByteArray prefix = qgetenv("DTW_PROFILE");
+    if (!prefix.isEmpty()) {
+        writeFile(prefix + ".json", profiler::toJson());
+        writeFile(prefix + ".trace.json", profiler::toChromeTrace());
+    }
+#endif
+    isRegistryDestroyed = true;
+}
+
+}//namespace
+
+profiler::Scope::Scope(const char * name)
+    : data(0), node(0), start(0), allocatedAtStart(0), liveAtStart(0), outerPeak(0)
+{
+    if (!isEnabled()) return;
+    Bookkeeping bookkeeping;
+    data = currentThread();
+    {
+        QMutexLocker lock(&data->mutex);
+        const int parent = data->current;
+        node = -1;
+        foreach (int child, data->nodes[parent].children) {
+            const char * const childName = data->nodes[child].name;
+            if (childName == name || std::strcmp(childName, name) == 0) {
+                node = child;
+                break;
+            }
+        }
+        if (node < 0) {
+            node = data->nodes.size();
+            data->nodes.append(Node(name, parent));
+            data->nodes[parent].children.append(node);
+        }
+        data->current = node;
+    }
+    allocatedAtStart = allocatedBytes;
+    liveAtStart = liveBytes;
+    outerPeak = peakBytes;
+    peakBytes = liveBytes;
+    start = registry().clock.nsecsElapsed();
+}
+
+profiler::Scope::~Scope()
+{
+    if (!data) return;
+    const qint64 end = registry().clock.nsecsElapsed();
+    const qint64 duration = end - start;
+    const qint64 allocated = allocatedBytes - allocatedAtStart;
+    const qint64 peak = peakBytes - liveAtStart;
+    peakBytes = qMax(outerPeak, peakBytes);
+
+    Bookkeeping bookkeeping;
+    QMutexLocker lock(&data->mutex);
+    Node& n = data->nodes[node];
+    n.calls++;
+    n.total += duration;
+    n.min = qMin(n.min, duration);
+    n.max = qMax(n.max, duration);
+    n.allocated += allocated;
+    n.peak = qMax(n.peak, peak);
+    if (n.samples.size() < MAX_SAMPLES) {
+        n.samples.append(duration);
+    } else {
+        data->random = data->random * 1664525u + 1013904223u;
+        const qint64 slot = data->random % quint64(n.calls);
+        if (slot < MAX_SAMPLES) n.samples[int(slot)] = duration;
+    }
+    QAtomicInt& events = registry().events;
+    if (events.loadAcquire() < MAX_EVENTS && events.fetchAndAddRelaxed(1) < MAX_EVENTS) {
+        const Event event = { n.name, data->id, start, duration };
+        data->events.append(event);
+    }
+    data->current = n.parent;
+}
+
+bool profiler::isEnabled()
+{
+    return registry().enabled.loadAcquire() != 0;
+}
+
+void profiler::setEnabled(bool enabled)
+{
+    registry().enabled.storeRelease(enabled ? 1 : 0);
+}
+
+void profiler::reset()
+{
+    Bookkeeping bookkeeping;
+    Registry& r = registry();
+    QMutexLocker lock(&r.mutex);
+    foreach (const QSharedPointer<ThreadData>& data, r.threads) {
+        QMutexLocker threadLock(&data->mutex);
+        for (Node& node : data->nodes)
+            node.clear();
+        data->events.clear();
+    }
+    r.retired.nodes.resize(1);
+    r.retired.nodes[0].children.clear();
+    r.retired.events.clear();
+    r.events.storeRelease(0);
+}
+
+QByteArray profiler::toJson()
+{
+    Bookkeeping bookkeeping;
+    Registry& r = registry();
+    QMutexLocker lock(&r.mutex);
+    QList<ThreadData *> threads;
+    threads.append(&r.retired);
+    foreach (const QSharedPointer<ThreadData>& data, r.threads)
+        threads.append(data.data());
+    QByteArray out("{\"threads\":[");
+    for (int t = 0; t < threads.size(); t++) {
+        ThreadData& data = *threads[t];
+        QMutexLocker threadLock(&data.mutex);
+        if (t > 0) out.append(',');
+        out.append("{\"id\":").append(QByteArray::number(data.id)).append(",\"calls\":[");
+        const QVector<int>& roots = data.nodes[0].children;
+        for (int i = 0; i < roots.size(); i++) {
+            if (i > 0) out.append(',');
+            appendNode(out, data, roots[i]);
+        }
+        out.append("]}");
+    }
+    out.append("]}\n");
+    return out;
+}
+
+QByteArray profiler::toChromeTrace()
+{
+    Bookkeeping bookkeeping;
+    Registry& r = registry();
+    QMutexLocker lock(&r.mutex);
+    QByteArray out("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    QList<ThreadData *> threads;
+    threads.append(&r.retired);
+    foreach (const QSharedPointer<ThreadData>& data, r.threads)
+        threads.append(data.data());
+    bool isFirst = true;
+    foreach (ThreadData * data, threads) {
+        QMutexLocker threadLock(&data->mutex);
+        for (const Event& event : data->events) {
+            if (!isFirst) out.append(',');
+            isFirst = false;
+            out.append("\n{\"name\":");
+            appendEscaped(out, event.name);
+            out.append(",\"ph\":\"X\",\"pid\":1,\"tid\":").append(QByteArray::number(event.thread));
+            out.append(",\"ts\":").append(micros(event.start));
+            out.append(",\"dur\":").append(micros(event.duration)).append('}');
+        }
+    }
+    out.append("\n]}\n");
+    return out;
+}
+
+#ifdef DTW_WRAP_ALLOCATOR
+//glibc lets the process replace its allocator, these wrap the original one
+//and keep the thread's counters. A block is subtracted from the thread that
+//frees it, which is not always the one that allocated it.
+extern "C" {
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void * p, size_t size);
+void * __libc_memalign(size_t alignment, size_t size);
+void * __libc_valloc(size_t size);
+void * __libc_pvalloc(size_t size);
+void __libc_free(void * p);
+
+static inline void countAllocation(void * p)
+{
+    if (!p || isBookkeeping) return;
+    const qint64 size = qint64(malloc_usable_size(p));
+    allocatedBytes += size;
+    liveBytes += size;
+    peakBytes = qMax(peakBytes, liveBytes);
+}
+
+static inline void countRelease(void * p)
+{
+    if (!p || isBookkeeping) return;
+    liveBytes -= qint64(malloc_usable_size(p));
+}
+
+void * malloc(size_t size)
+{
+    void * p = __libc_malloc(size);
+    countAllocation(p);
+    return p;
+}
+
+void * calloc(size_t count, size_t size)
+{
+    void * p = __libc_calloc(count, size);
+    countAllocation(p);
+    return p;
+}
+
+void * realloc(void * p, size_t size)
+{
+    countRelease(p);
+    void * q = __libc_realloc(p, size);
+    countAllocation(q ? q : (size ? p : 0));
+    return q;
+}
+
+void * reallocarray(void * p, size_t count, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return 0;
+    }
+    return realloc(p, total);
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+    void * p = __libc_memalign(alignment, size);
+    countAllocation(p);
+    return p;
+}
+
+void * aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void ** p, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0)
+        return EINVAL;
+    void * q = memalign(alignment, size);
+    if (!q) return ENOMEM;
+    *p = q;
+    return 0;
+}
+
+void * valloc(size_t size)
+{
+    void * p = __libc_valloc(size);
+    countAllocation(p);
+    return p;
+}
+
+void * pvalloc(size_t size)
+{
+    void * p = __libc_pvalloc(size);
+    countAllocation(p);
+    return p;
+}
+
+void free(void * p)
+{
+    countRelease(p);
+    __libc_free(p);
+}
+}
+#endif
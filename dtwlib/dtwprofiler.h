@@ -0,0 +1,76 @@
+/*****************************************************************************
+ *                          Dye The World Project                            *
+ *   Copyright (C) 2016  Alexey Novikov (novikov_DOT_aleksey@gmail_DOT_com)  *
+ *                                                                           *
+ *  This program is free software: you can redistribute it and/or modify     *
+ *  it under the terms of the GNU Affero General Public License as           *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  This program is distributed in the hope that it will be useful,          *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Affero General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Affero General Public License *
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.    *
+ *****************************************************************************/
+
+#ifndef DTWPROFILER_H
+#define DTWPROFILER_H
+
+#include <QtGlobal>
+#include <QByteArray>
+
+namespace dtw {
+namespace profiler {
+
+//Times the block it lives in and the heap allocated meanwhile. Scopes nest
+//into a call tree per thread, every node of which keeps the call count,
+//min/mean/max and percentiles of its wall time. The heap figures are only
+//collected with -DDTW_TRACE_ALLOCATIONS and are per-thread approximations:
+//a block freed by another thread than the one that allocated it lowers the
+//balance of the freeing thread.
+class Scope {
+public:
+    explicit Scope(const char * name);
+    ~Scope();
+
+private:
+    Q_DISABLE_COPY(Scope)
+    struct ThreadData * data;
+    int node;
+    qint64 start;
+    qint64 allocatedAtStart;
+    qint64 liveAtStart;
+    qint64 outerPeak;
+};
+
+//Scopes record nothing while disabled, they are enabled when DTW_PROFILE is set
+bool isEnabled();
+void setEnabled(bool enabled);
+//Clears the statistics, scopes still open are kept
+void reset();
+
+//The call trees of all threads with their statistics, threads that exited
+//are merged into the one with id 0
+QByteArray toJson();
+//Every scope as a complete event of the Chrome trace format,
+//for chrome://tracing or Perfetto
+QByteArray toChromeTrace();
+
+}//namespace profiler
+}//namespace dtw
+
+//Profiling scopes are compiled in with -DBENCH. Setting DTW_PROFILE=<prefix>
+//then writes <prefix>.json and <prefix>.trace.json when the process exits.
+#ifdef BENCH
+#define DTW_PROFILE_CONCAT_(a, b) a##b
+#define DTW_PROFILE_CONCAT(a, b) DTW_PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) dtw::profiler::Scope DTW_PROFILE_CONCAT(profileScope, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#endif
+#define PROFILE_FUNCTION() PROFILE_SCOPE(Q_FUNC_INFO)
+
+#endif // DTWPROFILER_H